@@ -0,0 +1,2 @@
+clang main.c -I ../inc -O3 -lm -pthread -o ubench
+./ubench
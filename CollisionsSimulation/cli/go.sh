@@ -1 +1 @@
-for i in {1..64}; do nohup ./ucc > /dev/null 2>&1 & done
\ No newline at end of file
+./ucc -t $(nproc) -k 64 -c 25600000
\ No newline at end of file
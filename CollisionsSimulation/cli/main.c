@@ -4,7 +4,7 @@
 
     Info:
 
-        This is the client version of dataset generation, multi-process.
+        This is the client version of dataset generation, multi-threaded.
 
         This produces the full simulation model, a neural network that
         feeds back its own output as input for the next step in the
@@ -21,20 +21,43 @@
 
         I really like this model because I can produce large unique
         datasets very quickly.
-        
-        This is configured to output 400,000 samples of data which is
+
+        By default this outputs 400,000 samples of data which is
         replayed at 60fps so that is 1.85 hours worth of data.
+
+        Each worker thread steps its own universes with the kernels of
+        inc/sim.h, inc/batch.h or inc/event.h and streams the X rows and
+        the label sets of inc/labels.h to its own self-describing shards
+        (inc/dsfile.h) through a background writer (inc/awrite.h), and
+        dataset.manifest lists them. A run only depends on its seed and
+        shard count, -v checks the selected kernel against the scalar
+        reference, and any unknown option prints the rest.
         
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 
 #include <sys/file.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+
+#ifdef __FAST_MATH__
+    #error "ucc must be built without -ffast-math or -Ofast, the datasets have to be reproducible"
+#endif
+#define VEC_STRICT
 
 #include "../inc/vec.h"
+#include "../inc/sim.h"
+#include "../inc/batch.h"
+#include "../inc/event.h"
+#include "../inc/awrite.h"
+#include "../inc/dsfile.h"
+#include "../inc/snap.h"
+#include "../inc/labels.h"
 
 #define f32 float
 
@@ -47,19 +70,68 @@
 //*************************************
 // globals
 //*************************************
-#define MAX_SPHERES 16
+uint NUM_SPHERES = 16;
 f32 SPHERE_SCALE = 0.16f;
 f32 SPHERE_SPEED = 0.003f;
+uint NUM_THREADS = 1;
+uint NUM_SHARDS = 0;  // 0 = one per thread
+uint64_t NUM_SAMPLES = 400000; // 0 = until interrupted
+uint BATCH = 0;     // universes per worker stepped in lockstep, 0 = single universe
+uint TRAJECTORY = 0; // write states once instead of X and Y pairs
+uint PAIRS = 0;     // symmetric once per pair resolution
+uint EVENTS = 0;    // event driven engine
+uint REORDER = 0;   // steps between Morton reorders of the sphere arrays, 0 = never
+uint CHECKPOINT = 0; // steps between shard checkpoints, 0 = never
+uint RESUME = 0;    // carry on from the checkpoints of a run
+uint ADVANCE = 1;   // steps from a row to the next of its universe
+uint JUMP = 0;      // jump over free flight between rows with sim_advance()
+uint BURNIN = 0;    // steps every universe takes before its first row
+uint HORIZON[DS_HORIZONS]; // steps from the X row to each label set of its Y row, ascending
+uint HORIZONS = 0;  // label sets per Y row, 0 = one at the stride
+const labelset* LABEL[LABEL_SETS]; // what each Y shard holds, the first is dataset_y
+uint LABELS = 0;
+snapfile START;     // -i, starting states, START.map is NULL if not given
+sim_step_fn step;   // single universe kernel
 
-typedef struct{vec pos, dir;} sphere;
-sphere spheres[MAX_SPHERES];
+#define CHUNK_FLOATS 1048576 // X floats per shard buffer (4mb), each shard has two
+#define JUMP_MAX 128 // spheres -J takes, sim_advance() keeps an n*n table of pair bounds and stepping is faster before it runs out
+volatile sig_atomic_t running = 1;
+awriter writer;
 
-#define MAX_MEM_X 38400000 // 400000*6*16
-#define MAX_MEM_Y 19200000 // MAX_MEM_X / 2
-// (~200mb for both files) (~13.5gb with 64 processes) (~27gb with 128 processes)
-f32 dataset_x[MAX_MEM_X];
-f32 dataset_y[MAX_MEM_Y];
-uint ix = 0, iy = 0;
+// a step's rows of every universe waiting for their later label sets
+typedef struct
+{
+    uint age;           // steps since its X rows
+    uint next;          // the horizon it waits for
+    uint rows;          // universes with a row in it
+} pending;
+
+typedef struct
+{
+    uint id;
+    uint64_t seed;      // of the run, universe u starts from stream shardStream(id) + u
+    uint64_t rows;      // samples this worker produces, 0 = until interrupted
+    uint64_t done;      // samples produced so far
+    uint64_t made;      // X rows written, ahead of done while rows wait for labels past the stride
+    uint64_t events;    // rows of the sparse label shard
+    uint64_t step;      // steps every universe has taken
+    uint64_t steps;     // since the last reorder
+    sim s;
+    simbatch b;
+    simevent e;         // when EVENTS, steps s
+    unsigned char* hit; // spheres that collided in the steps of the last advance
+    unsigned char* hits; // of one of those steps
+    int* partner;       // the sphere each last collided with, as hit
+    pending* wait;      // ring of row groups waiting for labels, oldest at head
+    f32* waity;         // their Y rows
+    unsigned char* since; // the spheres of each that collided since its X row, in sphere id order
+    int* partners;      // the sphere each of those last collided with
+    uint head, waiting, slots;
+    astream sx, sy[LABEL_SETS]; // shard files, X and one per label set
+    dsout hx, hy[LABEL_SETS]; // their headers and block indexes
+    int failed;         // the shard could not be opened or written
+} worker;
+worker* workers;
 
 //*************************************
 // utility functions
@@ -92,158 +164,964 @@ void writeWarning(const char* s)
     }
 }
 
-void dumpBuffers()
+void shardName(char* r, const char* prefix, const uint id)
+{
+    sprintf(r, "%s.%03u.dat", prefix, id);
+}
+
+uint physics()
+{
+    return EVENTS == 1 ? DS_PHYSICS_EVENTS : PAIRS == 1 ? DS_PHYSICS_PAIRS : DS_PHYSICS_ORDERED;
+}
+
+// universes stepped together, simBatchInit() rounds -k up to whole lanes
+uint perStep()
+{
+    return BATCH > 0 ? ((BATCH + SIM_LANES-1) & ~(SIM_LANES-1)) : 1;
+}
+
+// the random stream of the first universe of a shard, so what it holds does not depend on which thread made it or when
+uint64_t shardStream(const uint id)
+{
+    return (uint64_t)id << 32;
+}
+
+void sigStop(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+// append one universe to the X buffer, consecutive spheres are stride floats apart, in sphere id order if slot is not NULL
+void recordX(worker* w, const f32* x, const f32* y, const f32* z, const f32* dx, const f32* dy, const f32* dz, const uint stride, const uint* slot)
+{
+    f32* r = (f32*)asPtr(&w->sx);
+    for(uint i = 0; i < NUM_SPHERES; i++)
+    {
+        const uint o = (slot != NULL ? slot[i] : i)*stride;
+        *r++ = x[o];
+        *r++ = y[o];
+        *r++ = z[o];
+        *r++ = dx[o];
+        *r++ = dy[o];
+        *r++ = dz[o];
+    }
+    asCommit(&w->sx, NUM_SPHERES*6*sizeof(f32));
+}
+
+// the label set this project writes by default, -o picks any others
+#define Y_LABELS "directions"
+
+// floats of a Y row of one universe in the label sets before l, labelOffset(LABELS) is the whole row
+uint labelOffset(const uint l)
+{
+    uint f = 0;
+    for(uint i = 0; i < l; i++){f += LABEL[i]->floats;}
+    return f*NUM_SPHERES*HORIZONS;
+}
+
+// bytes of one universe's labels in the shard of label set l, at most that many for the sparse set
+size_t labelBytes(const uint l)
+{
+    if(LABEL[l]->sparse == 1){return (size_t)NUM_SPHERES*HORIZONS*sizeof(labelevent);}
+    return (labelOffset(l+1) - labelOffset(l))*sizeof(f32);
+}
+
+// the first label set goes to dataset_y, the others to a shard of their own name
+void labelPrefix(char* r, const uint l)
 {
-    // open and lock the X file and don't unlock until Y is also written to
-    int fx = open("dataset_x.dat", O_APPEND | O_CREAT | O_WRONLY, S_IRWXU);
-    if(fx > -1)
+    if(l == 0){sprintf(r, "dataset_y");}
+    else{sprintf(r, "dataset_%s", LABEL[l]->name);}
+}
+
+// a comma list of label set names, -1 if one is unknown or given twice
+int parseLabels(const char* list)
+{
+    char names[256];
+    snprintf(names, sizeof(names), "%s", list);
+    LABELS = 0;
+    for(char* t = strtok(names, ","); t != NULL; t = strtok(NULL, ","))
     {
-        // lock X
-        if(flock(fx, LOCK_EX) == -1) // very rare that these would hang forever unless there is some serious hard drive failure.
-            usleep(1000);
+        const labelset* l = labelFind(t);
+        if(l == NULL || LABELS == LABEL_SETS){return -1;}
+        for(uint i = 0; i < LABELS; i++)
+            if(LABEL[i] == l){return -1;}
+        LABEL[LABELS++] = l;
+    }
+    return LABELS > 0 ? 0 : -1;
+}
 
-        // append to X file
-        const size_t ixs = ix*sizeof(f32);
-        const ssize_t wb = write(fx, &dataset_x[0], ixs);
-        if(wb != ixs) // this is very rare but if it fails... well.. we have a log
+// written before the run with the target counts (0 = unlimited) and again after with what was written
+int writeManifest(const uint64_t seed, const uint written)
+{
+    FILE* f = fopen("dataset.manifest", "w");
+    if(f == NULL){return -1;}
+    fprintf(f, "# ucc dataset manifest\n");
+    fprintf(f, "spheres %u\n", NUM_SPHERES);
+    fprintf(f, "scale %g\n", SPHERE_SCALE);
+    fprintf(f, "speed %g\n", SPHERE_SPEED);
+    fprintf(f, "seed %lu\n", seed);
+    fprintf(f, "samples %lu\n", NUM_SAMPLES);
+    fprintf(f, "x_floats %u\n", NUM_SPHERES*6);
+    fprintf(f, "y_floats %u\n", NUM_SPHERES*LABEL[0]->floats*HORIZONS);
+    fprintf(f, "format %s\n", TRAJECTORY == 1 ? "trajectory" : "pairs");
+    fprintf(f, "universes %u\n", perStep());
+    fprintf(f, "physics %s\n", EVENTS == 1 ? "events" : PAIRS == 1 ? "pairs" : "ordered");
+    fprintf(f, "stride %u\n", ADVANCE);
+    fprintf(f, "jump %u\n", JUMP);
+    fprintf(f, "burnin %u\n", BURNIN);
+    fprintf(f, "horizons");
+    for(uint h = 0; h < HORIZONS; h++){fprintf(f, " %u", HORIZON[h]);}
+    fprintf(f, "\n");
+    if(TRAJECTORY == 0)
+    {
+        fprintf(f, "labels");
+        for(uint l = 0; l < LABELS; l++){fprintf(f, " %s", LABEL[l]->name);}
+        fprintf(f, "\n");
+    }
+    fprintf(f, "shards %u\n", NUM_SHARDS);
+    for(uint t = 0; t < NUM_SHARDS; t++)
+    {
+        const uint64_t rows = written == 1 ? workers[t].done : workers[t].rows;
+        char nx[64], ny[64], prefix[32];
+        shardName(nx, TRAJECTORY == 1 ? "dataset_t" : "dataset_x", t);
+        fprintf(f, "shard %s", nx);
+        for(uint l = 0; l < LABELS && TRAJECTORY == 0; l++)
         {
-            char emsg[256];
-            sprintf(emsg, "Just wrote corrupted bytes to X file! (last %zu bytes).", wb);
-            writeWarning(emsg);
-            exit(0);
+            labelPrefix(prefix, l);
+            shardName(ny, prefix, t);
+            fprintf(f, " %s", ny);
         }
+        fprintf(f, " %lu\n", rows);
+    }
+    fclose(f);
+    return 0;
+}
+
+// the seed of the run in this directory
+int readManifestSeed(uint64_t* seed)
+{
+    FILE* f = fopen("dataset.manifest", "r");
+    if(f == NULL){return -1;}
+    char line[256];
+    int r = -1;
+    while(r < 0 && fgets(line, sizeof(line), f) != NULL)
+        if(sscanf(line, "seed %lu", seed) == 1){r = 0;}
+    fclose(f);
+    return r;
+}
+
+//*************************************
+// worker
+//*************************************
+// open a shard, its header describes the rows and the block index is built as the writer flushes it, or keep its first rows and carry on
+int openShard(astream* s, dsout* d, const char* prefix, const uint id, const uint content, const uint row_floats, const uint universes, const uint64_t seed, const size_t cap, const uint resume, const uint64_t rows)
+{
+    char name[64];
+    shardName(name, prefix, id);
+    dsheader h = {0};
+    h.content = content;
+    h.spheres = NUM_SPHERES;
+    h.row_floats = row_floats;
+    h.universes = universes;
+    h.shard = id;
+    h.seed = seed;
+    h.scale = SPHERE_SCALE;
+    h.speed = SPHERE_SPEED;
+    h.physics = physics();
+    h.stride = ADVANCE;
+    h.burnin = BURNIN;
+    for(uint i = 0; i < HORIZONS; i++){h.horizon[i] = HORIZON[i];}
+    if(resume == 1 && dsResume(d, name, rows) < 0){return -1;}
+    if(resume == 0 && dsCreate(d, name, &h) < 0){return -1;}
+    if(asOpen(s, &writer, name, cap) < 0){return -1;}
+    asOnWrite(s, dsOnWrite, d);
+    return 0;
+}
+
+int workerInit(worker* w, const uint id, const uint64_t rows, const uint64_t seed)
+{
+    memset(w, 0, sizeof(worker));
+    w->id = id;
+    w->rows = rows;
+    w->seed = seed;
+
+    // a trajectory is made of whole frames
+    const uint per_step = perStep();
+    if(TRAJECTORY == 1 && rows % per_step != 0){w->rows += per_step - rows % per_step;}
+    return 0;
+}
+
+void snapName(char* r, const uint id)
+{
+    sprintf(r, "dataset.%03u.snap", id);
+}
+
+// universe u of the shard from record r of a snapshot
+int workerLoad(worker* w, const snapfile* f, const uint u, const uint64_t r)
+{
+    if(BATCH == 0){return snapGet(f, r, &w->s, &w->step, NULL);}
+    if(snapGet(f, r, &w->b.tmp, &w->step, NULL) < 0){return -1;}
+    simBatchSet(&w->b, u, &w->b.tmp);
+    return 0;
+}
 
-        // open Y file but we don't need to lock it as the X file lock is governing both
-        int fy = open("dataset_y.dat", O_APPEND | O_CREAT | O_WRONLY, S_IRWXU);
-        if(fy > -1)
+// the horizons of a header are those of this run, all zero in files from before they were recorded means one at the stride
+int sameHorizons(const uint16_t* horizon, const uint stride)
+{
+    for(uint i = 0; i < DS_HORIZONS; i++)
+    {
+        const uint got = i == 0 && horizon[0] == 0 ? stride : horizon[i];
+        if(got != (i < HORIZONS ? HORIZON[i] : 0)){return 0;}
+    }
+    return 1;
+}
+
+// carry on from the shard's checkpoint, 1 if there is none and it starts over
+int workerResume(worker* w)
+{
+    char name[64];
+    snapName(name, w->id);
+    snapfile f;
+    if(snapOpen(&f, name) < 0){return 1;}
+    const snapheader* h = &f.h;
+    int r = 0;
+    if(h->spheres != NUM_SPHERES || h->scale != SPHERE_SCALE || h->speed != SPHERE_SPEED || h->physics != physics() ||
+        h->seed != w->seed || h->count != perStep() || h->shard != w->id || (h->stride > 0 ? h->stride : 1) != ADVANCE){r = -1;}
+    if(sameHorizons(h->horizon, h->stride > 0 ? h->stride : 1) == 0){r = -1;}
+    for(uint u = 0; u < h->count && r == 0; u++){r = workerLoad(w, &f, u, u);}
+    w->done = w->made = h->rows;
+    w->events = h->events;
+    snapClose(&f);
+    return r;
+}
+
+// once the rows so far are on disk save the state that follows them, the data and the checkpoint always agree
+int workerCheckpoint(worker* w)
+{
+    if(asFlush(&w->sx) < 0){return -1;}
+    for(uint l = 0; l < LABELS && TRAJECTORY == 0; l++)
+        if(asFlush(&w->sy[l]) < 0){return -1;}
+    char name[64];
+    snapName(name, w->id);
+    snapheader h = {0};
+    h.spheres = NUM_SPHERES;
+    h.physics = physics();
+    h.scale = SPHERE_SCALE;
+    h.speed = SPHERE_SPEED;
+    h.seed = w->seed;
+    h.rows = w->done;
+    h.events = w->events;
+    h.shard = w->id;
+    h.stride = ADVANCE;
+    for(uint i = 0; i < HORIZONS; i++){h.horizon[i] = HORIZON[i];}
+    snapout o;
+    if(snapCreate(&o, name, &h) < 0){return -1;}
+    for(uint u = 0; u < perStep(); u++)
+    {
+        philox p;
+        pxSeed(&p, w->seed, shardStream(w->id) + u); // the stream it started from
+        if(BATCH > 0){simBatchGet(&w->b, u, &w->b.tmp);}
+        snapAdd(&o, BATCH > 0 ? &w->b.tmp : &w->s, w->step, &p);
+    }
+    return snapFinish(&o);
+}
+
+// k steps of every universe, with -J free flight is jumped over, hit gets the spheres that collided in any of them
+void workerAdvance(worker* w, const uint k)
+{
+    if(JUMP == 1 && k > 1)
+    {
+        sim_advance(&w->s, k, step, w->hit);
+        return;
+    }
+    const uint cells = perStep()*NUM_SPHERES;
+    for(uint i = 0; i < k; i++)
+    {
+        unsigned char* h = i == 0 ? w->hit : w->hits;
+        if(BATCH > 0){sim_step_batch(&w->b, h);}
+        else if(EVENTS == 1){evStep(&w->e, h);}
+        else{step(&w->s, h);}
+        if(i > 0)
+            for(uint c = 0; c < cells; c++)
+                w->hit[c] |= h[c];
+    }
+}
+
+// on the thread that makes the shard, so only the shards being made hold their state and buffers
+int workerOpen(worker* w)
+{
+    const uint id = w->id;
+    const uint64_t seed = w->seed;
+    const uint per_step = perStep();
+    if(BATCH > 0)
+    {
+        if(simBatchInit(&w->b, NUM_SPHERES, BATCH, SPHERE_SCALE, SPHERE_SPEED) < 0){return -1;}
+        simBatchRandomStream(&w->b, seed, shardStream(id));
+    }
+    else
+    {
+        if(simInit(&w->s, NUM_SPHERES, SPHERE_SCALE, SPHERE_SPEED) < 0){return -1;}
+        simRandomStream(&w->s, seed, shardStream(id));
+    }
+    w->hit = malloc(per_step*NUM_SPHERES);
+    w->hits = malloc(per_step*NUM_SPHERES);
+    w->partner = malloc(per_step*NUM_SPHERES*sizeof(int));
+    if(w->hit == NULL || w->hits == NULL || w->partner == NULL){return -1;}
+    if(BATCH > 0){w->b.partner = w->partner;}
+    else{w->s.partner = w->partner;}
+
+    // a row waits until its furthest labels, the rows made every stride in the meantime wait behind it
+    w->slots = HORIZON[HORIZONS-1] / ADVANCE + 1;
+    w->wait = malloc(w->slots*sizeof(pending));
+    w->waity = malloc((size_t)w->slots*per_step*labelOffset(LABELS)*sizeof(f32));
+    w->since = malloc((size_t)w->slots*per_step*NUM_SPHERES);
+    w->partners = malloc((size_t)w->slots*per_step*NUM_SPHERES*sizeof(int));
+    if(w->wait == NULL || w->waity == NULL || w->since == NULL || w->partners == NULL){return -1;}
+
+    // universe u of every shard is numbered id*per_step + u across the run and takes that record of -i, round robin
+    if(START.map != NULL)
+        for(uint u = 0; u < per_step; u++)
+            if(workerLoad(w, &START, u, ((uint64_t)id*per_step + u) % START.h.count) < 0){return -1;}
+
+    const int resume = RESUME == 1 ? workerResume(w) : 1;
+    if(resume < 0){return -1;}
+    if(EVENTS == 1 && evInit(&w->e, &w->s) != 0){return -1;}
+    if(resume == 1 && BURNIN > 0)
+    {
+        workerAdvance(w, BURNIN);
+        w->step += BURNIN;
+    }
+
+    // room for at least one step of every universe
+    size_t cap = CHUNK_FLOATS;
+    if(cap < per_step*NUM_SPHERES*6){cap = per_step*NUM_SPHERES*6;}
+
+    const uint append = resume == 0;
+    if(TRAJECTORY == 1)
+        return openShard(&w->sx, &w->hx, "dataset_t", id, DS_TRAJECTORY, NUM_SPHERES*6, per_step, seed, cap*sizeof(f32), append, w->done);
+    if(openShard(&w->sx, &w->hx, "dataset_x", id, DS_X, NUM_SPHERES*6, per_step, seed, cap*sizeof(f32), append, w->done) < 0){return -1;}
+    for(uint l = 0; l < LABELS; l++)
+    {
+        char prefix[32];
+        labelPrefix(prefix, l);
+        const uint floats = LABEL[l]->floats*HORIZONS;
+        const uint sparse = LABEL[l]->sparse;
+        size_t ycap = cap*floats/6*sizeof(f32);
+        if(ycap < per_step*labelBytes(l)){ycap = per_step*labelBytes(l);}
+        if(openShard(&w->sy[l], &w->hy[l], prefix, id, LABEL[l]->content, sparse == 1 ? LABEL_EVENT_FLOATS : NUM_SPHERES*floats, per_step, seed, ycap, append, sparse == 1 ? w->events : w->done) < 0){return -1;}
+    }
+    return 0;
+}
+
+void workerFree(worker* w)
+{
+    if(BATCH > 0){simBatchFree(&w->b);}
+    else
+    {
+        if(EVENTS == 1){evFree(&w->e);}
+        simFree(&w->s);
+    }
+    free(w->hit); free(w->hits); free(w->since);
+    free(w->partner); free(w->partners);
+    free(w->wait); free(w->waity);
+    w->hit = w->hits = w->since = NULL;
+    w->partner = w->partners = NULL;
+    w->wait = NULL;
+    w->waity = NULL;
+}
+
+// hand every full buffer to the writer together so X and Y stay row aligned on disk
+void swapShard(worker* w)
+{
+    int r = asSwap(&w->sx);
+    for(uint l = 0; l < LABELS && TRAJECTORY == 0; l++)
+        if(asSwap(&w->sy[l]) < 0){r = -1;}
+    if(r < 0)
+    {
+        char emsg[256];
+        sprintf(emsg, "Failed writing shard %u!", w->id);
+        writeWarning(emsg);
+        exit(0);
+    }
+}
+
+void checkpointFailed(worker* w)
+{
+    char emsg[256];
+    sprintf(emsg, "Failed to checkpoint shard %u.", w->id);
+    writeWarning(emsg);
+}
+
+// the label sets due now of the waiting rows, a group goes to the Y buffers once it has them all
+void workerLabel(worker* w, const uint k)
+{
+    const uint per_step = perStep();
+    const uint yrow = labelOffset(LABELS);
+    for(uint j = 0; j < w->waiting; j++)
+    {
+        const uint q = (w->head + j) % w->slots;
+        pending* p = &w->wait[q];
+        unsigned char* since = &w->since[q*per_step*NUM_SPHERES];
+        int* partners = &w->partners[q*per_step*NUM_SPHERES];
+        for(uint u = 0; u < p->rows; u++)
         {
-            // append to Y file
-            const size_t iys = iy*sizeof(f32);
-            const ssize_t wb = write(fy, &dataset_y[0], iys);
-            if(wb != iys) // this is very rare but if it fails... well.. we have a log
+            const unsigned char* hit = &w->hit[u*NUM_SPHERES];
+            const int* partner = &w->partner[u*NUM_SPHERES];
+            for(uint i = 0; i < NUM_SPHERES; i++)
             {
-                char emsg[256];
-                sprintf(emsg, "Just wrote corrupted bytes toY file! (last %zu bytes).", wb);
-                writeWarning(emsg);
-                exit(0);
+                // the kernels only write a partner on a collision, so it is this span's where hit is set
+                const uint o = BATCH > 0 ? i : simSlot(&w->s, i);
+                if(hit[o] == 0){continue;}
+                since[u*NUM_SPHERES + i] = 1;
+                partners[u*NUM_SPHERES + i] = partner[o];
             }
-
-            // close Y
-            close(fy);
         }
-        else
+        p->age += k;
+        if(p->age != HORIZON[p->next]){continue;}
+        f32* y = &w->waity[(size_t)q*per_step*yrow];
+        for(uint u = 0; u < p->rows; u++)
         {
-            writeWarning("Failed to open Y file.");
-            exit(0);
+            labelview v = {0};
+            v.n = NUM_SPHERES;
+            v.hit = &since[u*NUM_SPHERES];
+            v.partner = &partners[u*NUM_SPHERES];
+            if(BATCH > 0)
+            {
+                const simbatch* b = &w->b;
+                const uint o = simBatchIndex(b, u, 0);
+                v.x = &b->x[o], v.y = &b->y[o], v.z = &b->z[o];
+                v.dx = &b->dx[o], v.dy = &b->dy[o], v.dz = &b->dz[o];
+                v.stride = SIM_LANES;
+            }
+            else
+            {
+                const sim* s = &w->s;
+                v.x = s->x, v.y = s->y, v.z = s->z;
+                v.dx = s->dx, v.dy = s->dy, v.dz = s->dz;
+                v.stride = 1;
+                v.slot = s->slot;
+            }
+            for(uint l = 0; l < LABELS; l++)
+                LABEL[l]->write(&y[u*yrow + labelOffset(l) + p->next*NUM_SPHERES*LABEL[l]->floats], &v);
         }
+        p->next++;
+    }
 
-        // unlock X
-        if(flock(fx, LOCK_UN) == -1)
-            usleep(1000);
-
-        // close X
-        close(fx);
+    // whole groups leave in the order they were made, each label set to its own shard
+    while(w->waiting > 0 && w->wait[w->head].next == HORIZONS)
+    {
+        const uint rows = w->wait[w->head].rows;
+        const f32* y = &w->waity[(size_t)w->head*per_step*yrow];
+        for(uint l = 0; l < LABELS; l++)
+            if(asFree(&w->sy[l]) < rows*labelBytes(l)){swapShard(w);}
+        for(uint l = 0; l < LABELS; l++)
+        {
+            const size_t bytes = labelBytes(l);
+            for(uint u = 0; u < rows; u++)
+            {
+                const f32* r = &y[u*yrow + labelOffset(l)];
+                if(LABEL[l]->sparse == 1)
+                {
+                    // only the spheres that collided, numbered by the row in this shard
+                    const uint c = labelEvents((labelevent*)asPtr(&w->sy[l]), r, w->done + u, NUM_SPHERES, HORIZONS);
+                    asCommit(&w->sy[l], c*sizeof(labelevent));
+                    w->events += c;
+                    continue;
+                }
+                memcpy(asPtr(&w->sy[l]), r, bytes);
+                asCommit(&w->sy[l], bytes);
+            }
+        }
+        w->done += rows;
+        w->head = (w->head + 1) % w->slots;
+        w->waiting--;
     }
 }
 
-//*************************************
-// Process Entry Point
-//*************************************
-int main(int argc, char** argv)
+// the X rows of the first rows universes, they wait for their labels unless this is a trajectory
+void workerRecord(worker* w, const uint rows)
 {
-    // init random starting state
-    srandf(urand());
-    for(uint i = 0; i < MAX_SPHERES; i++)
+    const size_t xrow = NUM_SPHERES*6*sizeof(f32);
+    if(asFree(&w->sx) < rows*xrow){swapShard(w);}
+    if(BATCH > 0)
+    {
+        const simbatch* b = &w->b;
+        for(uint u = 0; u < rows; u++)
+        {
+            const uint o = simBatchIndex(b, u, 0);
+            recordX(w, &b->x[o], &b->y[o], &b->z[o], &b->dx[o], &b->dy[o], &b->dz[o], SIM_LANES, NULL);
+        }
+    }
+    else
+    {
+        const sim* s = &w->s;
+        recordX(w, s->x, s->y, s->z, s->dx, s->dy, s->dz, 1, s->slot);
+    }
+    w->made += rows;
+    if(TRAJECTORY == 1)
     {
-        vRuvTA(&spheres[i].pos); // random point on inside of unit sphere
-        vRuvBT(&spheres[i].dir); // random point on outside of unit sphere
-        vNorm(&spheres[i].dir);
+        w->done += rows;
+        return;
     }
+    const uint q = (w->head + w->waiting++) % w->slots;
+    w->wait[q] = (pending){0, 0, rows};
+    memset(&w->since[q*perStep()*NUM_SPHERES], 0, perStep()*NUM_SPHERES);
+}
 
-    // pre-compute
-    const f32 SPHERE_SCALE_2 = SPHERE_SCALE*1.8f;
-    
-    // run full pelt until buffer is filled then dump it to a file and exit.
-    while(1)
+void workerMain(worker* w)
+{
+    const uint per_step = perStep();
+    const size_t xrow = NUM_SPHERES*6*sizeof(f32);
+    while(w->waiting > 0 || (running == 1 && (w->rows == 0 || w->made < w->rows)))
     {
-        for(uint i = 0; i < MAX_SPHERES; i++)
+        // a stopped run still finishes the labels of the rows it has made
+        if(running == 1 && (w->rows == 0 || w->made < w->rows))
         {
-            dataset_x[ix++] = spheres[i].pos.x;
-            dataset_x[ix++] = spheres[i].pos.y;
-            dataset_x[ix++] = spheres[i].pos.z;
-            dataset_x[ix++] = spheres[i].dir.x;
-            dataset_x[ix++] = spheres[i].dir.y;
-            dataset_x[ix++] = spheres[i].dir.z;
-
-            vec inc;
-            vMulS(&inc, spheres[i].dir, SPHERE_SPEED);
-            vAdd(&spheres[i].pos, spheres[i].pos, inc);
-
-            const f32 mod = vMod(spheres[i].pos);
-            if(mod > 1.f)
+            // a trajectory is made of whole frames
+            const uint64_t left = w->rows - w->made;
+            const uint rows = TRAJECTORY == 0 && w->rows != 0 && left < per_step ? left : per_step;
+            if(BATCH == 0 && REORDER > 0 && (w->steps += ADVANCE) >= REORDER)
             {
-                vec sd = spheres[i].pos;
-                vNorm(&sd);
+                simReorder(&w->s); // stays in the old order if out of memory
+                w->steps = 0;
+            }
+            workerRecord(w, rows);
+        }
 
-                vReflect(&spheres[i].dir, spheres[i].dir, sd);
-                vNorm(&spheres[i].dir); // hmm or not?
+        // on to the next row in spans that end wherever labels are due
+        for(uint at = 0; at < ADVANCE;)
+        {
+            uint k = ADVANCE - at;
+            for(uint j = 0; j < w->waiting; j++)
+            {
+                const pending* p = &w->wait[(w->head + j) % w->slots];
+                if(HORIZON[p->next] - p->age < k){k = HORIZON[p->next] - p->age;}
+            }
+            workerAdvance(w, k);
+            w->step += k;
+            at += k;
+            workerLabel(w, k);
+        }
 
-                vec ob = spheres[i].pos;
-                vNorm(&ob);
-                vInv(&ob);
+        // checkpoint every CHECKPOINT steps, or the first row after with -a, once every row made has its labels
+        if(CHECKPOINT > 0 && w->step % CHECKPOINT < ADVANCE && w->waiting == 0 && running == 1 && (w->rows == 0 || w->done < w->rows) && workerCheckpoint(w) < 0)
+            checkpointFailed(w);
+    }
+    if(CHECKPOINT > 0 && workerCheckpoint(w) < 0){checkpointFailed(w);}
 
-                vec inc;
-                vMulS(&inc, ob, (mod-1.f)+SPHERE_SPEED);
-                // vMulS(&inc, spheres[i].dir, (mod-1.f)+SPHERE_SPEED);
-                vAdd(&spheres[i].pos, spheres[i].pos, inc);
+    // the final frame of a trajectory is the labels of the last step
+    if(TRAJECTORY == 1)
+    {
+        const uint frame = per_step;
+        if(asFree(&w->sx) < frame*xrow){swapShard(w);}
+        for(uint u = 0; u < frame; u++)
+        {
+            if(BATCH > 0)
+            {
+                const simbatch* b = &w->b;
+                const uint o = simBatchIndex(b, u, 0);
+                recordX(w, &b->x[o], &b->y[o], &b->z[o], &b->dx[o], &b->dy[o], &b->dz[o], SIM_LANES, NULL);
             }
+            else
+                recordX(w, w->s.x, w->s.y, w->s.z, w->s.dx, w->s.dy, w->s.dz, 1, w->s.slot);
+        }
+    }
+}
 
-            uint did_collide = 0;
-            for(uint j = 0; j < MAX_SPHERES; j++)
+// thread t makes shards t, t+NUM_THREADS, ... one after another
+void* threadMain(void* arg)
+{
+    for(uint id = (uint)(uintptr_t)arg; id < NUM_SHARDS; id += NUM_THREADS)
+    {
+        worker* w = &workers[id];
+        if(workerOpen(w) < 0)
+        {
+            char emsg[256];
+            sprintf(emsg, RESUME == 1 ? "Failed to open or resume shard %u, resume with the options of the run." : "Failed to open shard %u.", id);
+            writeWarning(emsg);
+            w->failed = 1;
+            continue;
+        }
+        workerMain(w);
+        if(asClose(&w->sx) < 0){w->failed = 1;}
+        for(uint l = 0; l < LABELS && TRAJECTORY == 0; l++)
+            if(asClose(&w->sy[l]) < 0){w->failed = 1;}
+        workerFree(w);
+    }
+    return NULL;
+}
+
+//*************************************
+// Process Entry Point
+//*************************************
+int main(int argc, char** argv)
+{
+    // options
+    uint scalar = 0, grid = 0, lists = 0, verify = 0, seeded = 0;
+    uint64_t seed = 0;
+    const char* start = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "n:r:p:t:j:c:k:f:o:m:a:b:h:d:w:i:RJyesglv:")) != -1)
+    {
+        if(opt == 'n'){NUM_SPHERES = atoi(optarg);}
+        else if(opt == 'r'){SPHERE_SCALE = atof(optarg);}
+        else if(opt == 'p'){SPHERE_SPEED = atof(optarg);}
+        else if(opt == 't'){NUM_THREADS = atoi(optarg);}
+        else if(opt == 'j'){NUM_SHARDS = atoi(optarg);}
+        else if(opt == 'd'){seed = strtoull(optarg, NULL, 10); seeded = 1;}
+        else if(opt == 'c'){NUM_SAMPLES = strtoull(optarg, NULL, 10);}
+        else if(opt == 'k'){BATCH = atoi(optarg);}
+        else if(opt == 'f'){TRAJECTORY = optarg[0] == 't';}
+        else if(opt == 'o')
+        {
+            if(parseLabels(optarg) < 0)
             {
-                if(j == i){continue;} // dont collide with self
+                printf("-o takes up to %u of positions,directions,flags,partners,sparse once each.\n", LABEL_SETS);
+                return 1;
+            }
+        }
+        else if(opt == 'm'){REORDER = atoi(optarg);}
+        else if(opt == 'a'){ADVANCE = atoi(optarg);}
+        else if(opt == 'b'){BURNIN = atoi(optarg);}
+        else if(opt == 'h')
+        {
+            HORIZONS = 0;
+            for(char* t = strtok(optarg, ","); t != NULL; t = strtok(NULL, ","))
+            {
+                if(HORIZONS == DS_HORIZONS){HORIZONS++; break;}
+                HORIZON[HORIZONS++] = atoi(t);
+            }
+        }
+        else if(opt == 'w'){CHECKPOINT = atoi(optarg);}
+        else if(opt == 'R'){RESUME = 1;}
+        else if(opt == 'J'){JUMP = 1;}
+        else if(opt == 'i'){start = optarg;}
+        else if(opt == 'y'){PAIRS = 1;}
+        else if(opt == 'e'){EVENTS = 1;}
+        else if(opt == 's'){scalar = 1;}
+        else if(opt == 'g'){grid = 1;}
+        else if(opt == 'l'){lists = 1;}
+        else if(opt == 'v'){verify = atoi(optarg);}
+        else
+        {
+            printf("Usage: %s [-n spheres] [-r scale] [-p speed] [-t threads] [-j shards] [-d seed] [-c samples] [-k universes] [-f p|t] [-o labels] [-a steps [-J]] [-b steps] [-h steps,...] [-y [-m steps]|-e] [-s|-g|-l] [-w steps] [-R] [-i file] [-v steps]\n", argv[0]);
+            printf("  -n spheres    number of spheres (default 16)\n");
+            printf("  -r scale      sphere scale (default 0.16)\n");
+            printf("  -p speed      sphere speed per step (default 0.003)\n");
+            printf("  -t threads    worker threads, they share out the shards (default 1)\n");
+            printf("  -j shards     shard files, each with its own universes (default one per thread)\n");
+            printf("  -d seed       regenerate the run with this seed, the data depends on the seed and -j, not -t\n");
+            printf("  -c samples    total samples to generate, 0 runs until interrupted (default 400000)\n");
+            printf("  -k universes  step this many independent universes in lockstep per worker, one per SIMD lane\n");
+            printf("  -f p|t        output X and Y pairs (default) or a trajectory of states\n");
+            printf("  -o labels     label sets to write in the one pass, the first to dataset_y, of positions,directions,flags,partners,sparse (default %s)\n", Y_LABELS);
+            printf("  -a steps      each row is this many steps after the last (default 1)\n");
+            printf("  -J            with -a, jump over free flight between rows, at most %u spheres, only faster with few, small or slow spheres\n", JUMP_MAX);
+            printf("  -b steps      burn-in, every universe takes this many steps before its first row (default 0)\n");
+            printf("  -h steps,...  label each X row with the state this many steps later, side by side in Y (default the stride)\n");
+            printf("  -y            resolve each pair once against a snapshot of the step, order independent\n");
+            printf("  -m steps      with -y, sort the spheres in memory by Morton order every this many steps\n");
+            printf("  -e            event driven engine, exact impact times sampled every step\n");
+            printf("  -s            use the scalar reference step\n");
+            printf("  -g            use the grid broad phase step\n");
+            printf("  -l            use the verlet neighbour list step\n");
+            printf("  -w steps      checkpoint every shard to dataset.NNN.snap every this many steps and when it ends\n");
+            printf("  -R            resume the run in this directory from its checkpoints, with the same options\n");
+            printf("  -i file       start the universes from the states in a snapshot file, in turn\n");
+            printf("  -v steps      compare the selected step against the scalar reference bit-for-bit, with -J the rows within 1e-4, and exit\n");
+            return 1;
+        }
+    }
+    if(NUM_SHARDS == 0){NUM_SHARDS = NUM_THREADS;}
+    if(NUM_SPHERES < 1 || ADVANCE < 1 || NUM_THREADS < 1 || NUM_THREADS > 1000 || NUM_SHARDS > 1000)
+    {
+        printf("Need at least 1 sphere and step and between 1 and 1000 threads and shards.\n");
+        return 1;
+    }
+    if(NUM_THREADS > NUM_SHARDS){NUM_THREADS = NUM_SHARDS;}
+    if(NUM_SAMPLES == 0 && NUM_SHARDS > NUM_THREADS)
+    {
+        printf("-c 0 runs until interrupted and needs a thread for every shard.\n");
+        return 1;
+    }
+    if(HORIZONS > 0 && TRAJECTORY == 1)
+    {
+        printf("-h is for X and Y pairs, a trajectory has every horizon.\n");
+        return 1;
+    }
+    if(HORIZONS == 0){HORIZON[HORIZONS++] = ADVANCE;}
+    uint ascending = HORIZONS <= DS_HORIZONS;
+    for(uint h = 0; h < HORIZONS && ascending == 1; h++)
+        if(HORIZON[h] < 1 || HORIZON[h] > 65535 || (h > 0 && HORIZON[h] <= HORIZON[h-1])){ascending = 0;}
+    if(ascending == 0)
+    {
+        printf("Up to %u horizons in ascending order between 1 and 65535 steps.\n", DS_HORIZONS);
+        return 1;
+    }
+    if((CHECKPOINT > 0 || RESUME == 1) && HORIZON[HORIZONS-1] > ADVANCE)
+    {
+        printf("-w and -R need every horizon within the stride, a checkpoint only holds rows that have all their labels.\n");
+        return 1;
+    }
+    if(LABELS == 0){parseLabels(Y_LABELS);}
+    uint derived = 1;
+    for(uint l = 0; l < LABELS; l++){derived &= LABEL[l]->trajectory;}
+    if(TRAJECTORY == 1 && derived == 0)
+    {
+        printf("The labels of this dataset can not be derived from a trajectory.\n");
+        return 1;
+    }
 
-                const f32 d = vDist(spheres[i].pos, spheres[j].pos);
-                if(d < SPHERE_SCALE_2)
-                {
-                    // reflect the ball direction
-                    vReflect(&spheres[i].dir, spheres[j].dir, spheres[i].dir);
-                    vNorm(&spheres[i].dir);
+    if(PAIRS == 1 && BATCH > 0)
+    {
+        printf("-y can not be used with -k, the batch kernel only has the ordered loop.\n");
+        return 1;
+    }
+    if(REORDER > 0 && (PAIRS == 0 || BATCH > 0))
+    {
+        printf("-m needs -y and can not be used with -k, the ordered loop depends on the sphere order.\n");
+        return 1;
+    }
+    if(EVENTS == 1 && (BATCH > 0 || PAIRS == 1))
+    {
+        printf("-e can not be used with -k or -y.\n");
+        return 1;
+    }
+    if(JUMP == 1 && (BATCH > 0 || EVENTS == 1))
+    {
+        printf("-J can not be used with -k or -e, it jumps a single universe of the stepped model.\n");
+        return 1;
+    }
+    if(JUMP == 1 && NUM_SPHERES > JUMP_MAX)
+    {
+        printf("-J takes at most %u spheres, it measures every pair and beyond that stepping is faster.\n", JUMP_MAX);
+        return 1;
+    }
+    if(EVENTS == 1 && (CHECKPOINT > 0 || RESUME == 1))
+    {
+        printf("-w and -R can not be used with -e, the event engine keeps double precision state a snapshot does not hold.\n");
+        return 1;
+    }
+    if(EVENTS == 1 && NUM_SPHERES * powf(SPHERE_SCALE*0.9f, 3.f) > 0.5f)
+    {
+        printf("Too dense for the event engine, the spheres fill more than half the unit sphere.\n");
+        return 1;
+    }
+
+    // pick the step kernel, the reference is the scalar loop of the same model
+    const sim_step_fn reference = PAIRS == 1 ? sim_step_pairs : sim_step;
+    step = PAIRS == 1 ? simSelectPairs(NUM_SPHERES) : simSelectStep(NUM_SPHERES);
+    if(scalar == 1){step = reference;}
+    if(grid == 1){step = PAIRS == 1 ? sim_step_pairs_grid : sim_step_grid;}
+    if(lists == 1 && PAIRS == 0){step = sim_step_verlet;}
 
-                    // increment the ball to a non-inersecting distance in the new direction
-                    vec inc;
-                    vMulS(&inc, spheres[i].dir, (SPHERE_SCALE_2-d)+SPHERE_SPEED);
-                    vAdd(&spheres[i].pos, spheres[i].pos, inc);
+    if(RESUME == 1 && seeded == 0)
+    {
+        if(readManifestSeed(&seed) < 0)
+        {
+            printf("Nothing to resume, there is no dataset.manifest here.\n");
+            return 1;
+        }
+        seeded = 1;
+    }
+    if(seeded == 0){seed = urand();}
+    if(start != NULL && (snapOpen(&START, start) < 0 || START.h.spheres != NUM_SPHERES))
+    {
+        printf("%s is not a snapshot of %u spheres.\n", start, NUM_SPHERES);
+        return 1;
+    }
 
-                    // log collision
-                    did_collide = 1;
+    // the event engine has no reference, check it never overlaps or tunnels instead
+    if(verify > 0 && EVENTS == 1)
+    {
+        sim spheres;
+        simevent e;
+        if(simInit(&spheres, NUM_SPHERES, SPHERE_SCALE, SPHERE_SPEED) < 0){return 1;}
+        simRandomStream(&spheres, seed, 0);
+        if(evInit(&e, &spheres) != 0)
+        {
+            printf("The spheres can not be separated, too many or too large for the event engine.\n");
+            return 1;
+        }
+        const double cd = SPHERE_SCALE*1.8f, tol = 1e-5;
+        for(uint k = 0; k < verify; k++)
+        {
+            evStep(&e, NULL);
+            for(uint i = 0; i < NUM_SPHERES; i++)
+            {
+                vec pi, dir;
+                simGet(&spheres, i, &pi, &dir);
+                if(vMod(pi) > 1.f + tol)
+                {
+                    printf("Sphere %u is outside the unit sphere at step %u.\n", i, k);
+                    return 1;
+                }
+                for(uint j = i+1; j < NUM_SPHERES; j++)
+                {
+                    const vec pj = {spheres.x[j], spheres.y[j], spheres.z[j], 0.f};
+                    if(vDist(pi, pj) < cd - tol)
+                    {
+                        printf("Spheres %u and %u overlap at step %u.\n", i, j, k);
+                        return 1;
+                    }
                 }
             }
+        }
+        printf("%u steps with no overlap or tunnelling, %lu events.\n", verify, e.events);
+        return 0;
+    }
 
-            // dataset_y[iy++] = spheres[i].pos.x;
-            // dataset_y[iy++] = spheres[i].pos.y;
-            // dataset_y[iy++] = spheres[i].pos.z;
+    // jumping over free flight rounds differently to stepping, check each row lands where stepping from the same state does
+    if(verify > 0 && JUMP == 1 && ADVANCE > 1)
+    {
+        sim ref, spheres;
+        unsigned char *ha = malloc(NUM_SPHERES), *hs = malloc(NUM_SPHERES), *hr = malloc(NUM_SPHERES);
+        if(simInit(&ref, NUM_SPHERES, SPHERE_SCALE, SPHERE_SPEED) < 0 ||
+            simInit(&spheres, NUM_SPHERES, SPHERE_SCALE, SPHERE_SPEED) < 0 || ha == NULL || hs == NULL || hr == NULL){return 1;}
+        simRandomStream(&ref, seed, 0);
+        uint64_t jumped = 0, late = 0;
+        double worst = 0.0, worst_hit = 0.0;
+        for(uint k = 0; k < verify; k += ADVANCE)
+        {
+            simCopy(&spheres, &ref);
+            jumped += sim_advance(&spheres, ADVANCE, step, ha);
+            memset(hs, 0, NUM_SPHERES);
+            for(uint a = 0; a < ADVANCE; a++)
+            {
+                reference(&ref, hr);
+                for(uint i = 0; i < NUM_SPHERES; i++){hs[i] |= hr[i];}
+            }
 
-            if(did_collide == 1)
+            // a collision or a grazing bounce can fall a step either side of a rounding difference, only free flight is held to the tolerance
+            for(uint i = 0; i < NUM_SPHERES; i++)
             {
-                dataset_y[iy++] = spheres[i].dir.x;
-                dataset_y[iy++] = spheres[i].dir.y;
-                dataset_y[iy++] = spheres[i].dir.z;
+                vec pa, pr, da, dr;
+                simGet(&spheres, simSlot(&spheres, i), &pa, &da);
+                simGet(&ref, simSlot(&ref, i), &pr, &dr);
+                const double d = vDist(pa, pr);
+                if(ha[i] == 1 || hs[i] == 1){if(d > worst_hit){worst_hit = d;}}
+                else if(vDist(da, dr) > 1e-5f){late++;}
+                else if(d > worst){worst = d;}
             }
-            else
+        }
+        printf("%lu of %u steps jumped, largest difference %g without collisions and %g with, %lu bounces a step apart.\n", jumped, verify, worst, worst_hit, late);
+        if(worst > 1e-4)
+        {
+            printf("Free flight is off by more than 1e-4.\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    // verify the vector kernel against the scalar reference
+    if(verify > 0)
+    {
+        sim ref, spheres;
+        if(simInit(&ref, NUM_SPHERES, SPHERE_SCALE, SPHERE_SPEED) < 0 ||
+            simInit(&spheres, NUM_SPHERES, SPHERE_SCALE, SPHERE_SPEED) < 0){return 1;}
+        if(BATCH > 0)
+        {
+            // every universe must match stepping it alone
+            simbatch universes;
+            if(simBatchInit(&universes, NUM_SPHERES, BATCH, SPHERE_SCALE, SPHERE_SPEED) < 0){return 1;}
+            simBatchRandomStream(&universes, seed, 0);
+            sim* refs = malloc(universes.k*sizeof(sim));
+            if(refs == NULL){return 1;}
+            for(uint u = 0; u < universes.k; u++)
             {
-                dataset_y[iy++] = 0.f;
-                dataset_y[iy++] = 0.f;
-                dataset_y[iy++] = 0.f;
+                if(simInit(&refs[u], NUM_SPHERES, SPHERE_SCALE, SPHERE_SPEED) < 0){return 1;}
+                simBatchGet(&universes, u, &refs[u]);
             }
-            
-            if(iy >= MAX_MEM_Y)
+            for(uint k = 0; k < verify; k++)
             {
-                // dump buffers and quit
-                dumpBuffers();
-                return 0;
+                sim_step_batch(&universes, NULL);
+                for(uint u = 0; u < universes.k; u++)
+                {
+                    sim_step(&refs[u], NULL);
+                    simBatchGet(&universes, u, &ref);
+                    if(simEqual(&refs[u], &ref) == 0)
+                    {
+                        printf("Mismatch at step %u in universe %u.\n", k, u);
+                        return 1;
+                    }
+                }
             }
         }
+        else
+        {
+            simRandomStream(&spheres, seed, 0);
+            simCopy(&ref, &spheres);
+            for(uint k = 0; k < verify; k++)
+            {
+                // the pair kernels must give the same result in Morton order, compared by sphere id
+                if(REORDER > 0 && (k+1) % REORDER == 0 && simReorder(&spheres) < 0){return 1;}
+                reference(&ref, NULL);
+                step(&spheres, NULL);
+                if(simEqual(&ref, &spheres) == 0)
+                {
+                    printf("Mismatch at step %u.\n", k);
+                    return 1;
+                }
+            }
+        }
+        printf("%u steps match bit-for-bit.\n", verify);
+        return 0;
+    }
+
+    // split the samples between the shards
+    workers = malloc(NUM_SHARDS*sizeof(worker));
+    pthread_t* threads = malloc(NUM_THREADS*sizeof(pthread_t));
+    if(workers == NULL || threads == NULL || awInit(&writer) < 0){return 1;}
+    for(uint t = 0; t < NUM_SHARDS; t++)
+    {
+        const uint64_t rows = NUM_SAMPLES/NUM_SHARDS + (t < NUM_SAMPLES%NUM_SHARDS);
+        if(workerInit(&workers[t], t, rows, seed) < 0)
+        {
+            writeWarning("Failed to start worker.");
+            return 1;
+        }
+    }
+    if(writeManifest(seed, 0) < 0)
+    {
+        writeWarning("Failed to write manifest.");
+        return 1;
+    }
+
+    // stop cleanly on Ctrl+C so the buffers get flushed
+    signal(SIGINT, sigStop);
+    signal(SIGTERM, sigStop);
+
+    printf("Seed %lu, ucc -d %lu -j %u regenerates this run.\n", seed, seed, NUM_SHARDS);
+
+    // run full pelt until every shard has its samples
+    for(uint t = 0; t < NUM_THREADS; t++)
+    {
+        if(pthread_create(&threads[t], NULL, threadMain, (void*)(uintptr_t)t) != 0)
+        {
+            writeWarning("Failed to create worker thread.");
+            return 1;
+        }
+    }
+    uint failed = 0;
+    for(uint t = 0; t < NUM_THREADS; t++){pthread_join(threads[t], NULL);}
+    for(uint t = 0; t < NUM_SHARDS; t++){failed |= workers[t].failed;}
+    awClose(&writer);
+    for(uint t = 0; t < NUM_SHARDS && failed == 0; t++)
+    {
+        if(dsFinish(&workers[t].hx, workers[t].done) < 0){failed = 1;}
+        for(uint l = 0; l < LABELS && TRAJECTORY == 0; l++)
+            if(dsFinish(&workers[t].hy[l], workers[t].done) < 0){failed = 1;}
+    }
+    if(failed == 1)
+    {
+        writeWarning("Failed flushing the shards.");
+        return 1;
+    }
+    if(writeManifest(seed, 1) < 0)
+    {
+        writeWarning("Failed to write manifest.");
+        return 1;
     }
 
     // done
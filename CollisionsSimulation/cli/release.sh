@@ -1,2 +1,2 @@
-clang main.c -I ../inc -Ofast -lm -o ucc
+clang main.c -I ../inc -O3 -ffp-contract=off -lm -pthread -o ucc
 upx ucc
\ No newline at end of file
@@ -0,0 +1,265 @@
+# James William Fletcher - May 2022
+# https://github.com/mrbid
+#
+# Loads the shards listed in dataset.manifest as numpy arrays.
+#
+# Every shard starts with the header from inc/dsfile.h so the sphere
+# count, row layout and row count are read from the file rather than
+# guessed from its size, and verify() checks the block checksums.
+#
+# Pair datasets (ucc -f p) are concatenated as they are, trajectory
+# datasets (ucc -f t) are memory mapped and the X and Y rows are
+# rebuilt from consecutive frames, with horizons=[1,2,4] each Y row is
+# the positions 1, 2 and 4 frames ahead side by side. Frames are the
+# manifest's stride steps apart (ucc -a), 1 unless it says otherwise.
+# The Y rows of pair datasets hold a label set for each of the
+# manifest's horizons in steps (ucc -h), all of them by default or
+# the ones asked for. A run can write several label sets (ucc -o),
+# label='flags' loads that one instead of the first. A sparse label
+# set (ucc -o sparse) only holds the spheres that collided, load()
+# expands it to the dense directions rows and balanced() reads just the
+# rows with a collision and a random sample of those without.
+#
+#   import dataset
+#   m = dataset.manifest()
+#   x, y = dataset.load(m)
+#   x, c = dataset.load(m, label='flags')
+#   x, y = dataset.balanced(m, negatives=1, label='sparse')
+#   for bx, by in dataset.batches(m, 4096, horizons=[1, 8]): ...
+#
+# python3 dataset.py verifies every shard, python3 dataset.py cat also
+# writes them out as the raw dataset_x.dat and dataset_y.dat that
+# shuff.py and the other scripts read.
+import sys
+import struct
+import numpy as np
+from os.path import isfile
+
+DS_MAGIC = 0x53444355
+DS_VERSION = 1
+DS_X, DS_Y_POSITION, DS_Y_DIRECTION, DS_TRAJECTORY, DS_Y_FLAG, DS_Y_PARTNER, DS_Y_SPARSE = 0, 1, 2, 3, 4, 5, 6
+DS_PHYSICS_ORDERED, DS_PHYSICS_PAIRS, DS_PHYSICS_EVENTS = 0, 1, 2
+DS_HORIZONS = 6
+HEADER = struct.Struct('<8IQ2f3Q2I2Q2I' + str(DS_HORIZONS) + 'HI4xI')
+FIELDS = ['magic', 'version', 'header_bytes', 'content', 'spheres', 'row_floats', 'universes', 'shard', 'seed',
+    'scale', 'speed', 'rows', 'samples', 'index_offset', 'blocks', 'complete', 'sum_a', 'sum_b', 'physics', 'stride']
+FIELDS += ['horizon' + str(i) for i in range(DS_HORIZONS)] + ['burnin', 'header_sum']
+EVENT = np.dtype([('row', '<u8'), ('sphere', '<u4'), ('horizon', '<u4'), ('d', '<f4', 3), ('reserved', '<u4')])
+CONTENT = {DS_Y_POSITION: 'positions', DS_Y_DIRECTION: 'directions', DS_Y_FLAG: 'flags', DS_Y_PARTNER: 'partners', DS_Y_SPARSE: 'sparse'}  # label set names of the Y contents
+
+def checksum(data):
+    # the running sums of inc/dsfile.h over uint32 words, a += w then b += a, modulo 2^64
+    w = np.frombuffer(data, dtype='<u4').astype(np.uint64)
+    a = int(w.sum(dtype=np.uint64))
+    b = int((w * np.arange(w.shape[0], 0, -1, dtype=np.uint64)).sum(dtype=np.uint64))
+    return a, b
+
+def header(file):
+    with open(file, 'rb') as f:
+        raw = f.read(HEADER.size)
+    if len(raw) < HEADER.size: raise ValueError(file + ": not a dataset file")
+    h = dict(zip(FIELDS, HEADER.unpack(raw)))
+    if h['magic'] != DS_MAGIC: raise ValueError(file + ": not a dataset file")
+    if h['version'] != DS_VERSION: raise ValueError(file + ": dataset version " + str(h['version']) + " is not supported")
+    if checksum(raw[:HEADER.size-4])[1] & 0xffffffff != h['header_sum']: raise ValueError(file + ": damaged header")
+    h['stride'] = max(h['stride'], 1)
+    h['horizons'] = [v for v in [h.pop('horizon' + str(i)) for i in range(DS_HORIZONS)] if v > 0] or [h['stride']]
+    if h['complete'] == 0:
+        # the run did not finish, use every whole row
+        size = np.memmap(file, dtype=np.uint8, mode='r').shape[0]
+        h['rows'] = (size - h['header_bytes']) // (h['row_floats']*4)
+        h['samples'] = max(h['rows'] - h['universes'], 0) if h['content'] == DS_TRAJECTORY else h['rows']
+        print(file + ": incomplete, reading", h['rows'], "rows")
+    return h
+
+def rows(file):
+    # the rows of a shard as a (rows, row_floats) memory map and its header
+    h = header(file)
+    r = np.memmap(file, dtype=np.float32, mode='r', offset=h['header_bytes'], shape=(h['rows'], h['row_floats']))
+    return r, h
+
+def verify(file):
+    # returns the number of bad blocks, or -1 if the file has no index
+    h = header(file)
+    if h['complete'] == 0: return -1
+    raw = np.memmap(file, dtype=np.uint8, mode='r')
+    index = np.frombuffer(raw[h['index_offset']:h['index_offset'] + h['blocks']*32], dtype='<u8').reshape(-1, 4)
+    bad = 0
+    a = b = 0
+    for offset, n, sa, sb in index:
+        bytes = int(n) * h['row_floats'] * 4
+        na, nb = checksum(raw[int(offset):int(offset)+bytes])
+        if na != int(sa) or nb != int(sb): bad += 1
+        b = (b + (bytes//4) * a + nb) % 2**64
+        a = (a + na) % 2**64
+    if bad == 0 and (a != h['sum_a'] or b != h['sum_b']): bad += 1
+    return bad
+
+def manifest(file="dataset.manifest"):
+    m = {'format': 'pairs', 'universes': 1, 'physics': 'ordered', 'stride': 1, 'burnin': 0, 'files': []}
+    with open(file) as f:
+        for line in f:
+            p = line.split()
+            if len(p) == 0 or p[0] == '#': continue
+            if p[0] == 'shard': m['files'].append(p[1:])
+            elif p[0] in ('scale', 'speed'): m[p[0]] = float(p[1])
+            elif p[0] in ('format', 'physics'): m[p[0]] = p[1]
+            elif p[0] == 'horizons': m[p[0]] = [int(v) for v in p[1:]]
+            elif p[0] == 'labels': m[p[0]] = p[1:]
+            else: m[p[0]] = int(p[1])
+    if 'horizons' not in m: m['horizons'] = [m['stride']]
+    return m
+
+def frames(shard):
+    # one trajectory shard as a (frames, universes, spheres, 6) array
+    t, h = rows(shard[0])
+    if h['content'] != DS_TRAJECTORY: raise ValueError(shard[0] + ": not a trajectory")
+    k = h['universes']
+    f = h['rows'] // k
+    return t[:f*k].reshape(f, k, h['spheres'], 6)
+
+def pairs(shard, horizons=[1]):
+    # the X and Y rows of one trajectory shard, a sample is only made if every horizon exists
+    t = frames(shard)
+    n = t.shape[2]
+    last = max(horizons)
+    f = t.shape[0] - last
+    if f <= 0: return np.zeros((0, n*6), np.float32), np.zeros((0, n*3*len(horizons)), np.float32)
+    x = t[:f].reshape(-1, n*6)
+    y = np.concatenate([t[h:h+f, :, :, 0:3].reshape(-1, n*3) for h in horizons], axis=1)
+    return x, y
+
+def events(file):
+    # the labelevents of a sparse shard as a memory map and its header
+    h = header(file)
+    if h['content'] != DS_Y_SPARSE: raise ValueError(file + ": not a sparse label shard")
+    e = np.memmap(file, dtype=EVENT, mode='r', offset=h['header_bytes'], shape=(h['rows'],))
+    return e, h
+
+def covered(e, h):
+    # the X rows a sparse shard has every event of, an unfinished one may have lost the events after its last row
+    if h['complete'] == 1: return h['samples']
+    return int(e['row'][-1]) if e.shape[0] > 0 else 0
+
+def dense(e, h, r):
+    # the directions rows r (ascending) of a sparse shard, zeros for every sphere that did not collide
+    y = np.zeros((r.shape[0], len(h['horizons']), h['spheres'], 3), np.float32)
+    e = e[np.isin(e['row'], r)]
+    y[np.searchsorted(r, e['row']), e['horizon'], e['sphere']] = e['d']
+    return y.reshape(r.shape[0], -1)
+
+def labelfile(m, label):
+    # where a label set is in the shard lines of the manifest, the first by default
+    if label is None: return 1
+    if label not in m.get('labels', []): raise ValueError("the dataset has no " + label + " labels")
+    return 1 + m['labels'].index(label)
+
+def labels(y, h, horizons):
+    # the label sets of the given horizons from Y rows with one per horizon the shard recorded
+    w = y.shape[1] // len(h['horizons'])
+    for v in horizons:
+        if v not in h['horizons']: raise ValueError("the Y rows have horizons " + str(h['horizons']) + ", not " + str(v))
+    return np.concatenate([y[:, h['horizons'].index(v)*w:(h['horizons'].index(v)+1)*w] for v in horizons], axis=1)
+
+def load(m, horizons=None, label=None):
+    # horizons are frames of a trajectory, [1] by default, or steps the Y rows of pairs hold, all of them by default
+    # label is one of the manifest's label sets, the first by default
+    xs = []
+    ys = []
+    f = labelfile(m, label)
+    for s in m['files']:
+        if m['format'] == 'trajectory':
+            x, y = pairs(s, horizons or [1])
+        else:
+            x, hx = rows(s[0])
+            if header(s[f])['content'] == DS_Y_SPARSE:
+                e, hy = events(s[f])
+                n = covered(e, hy)
+            else:
+                y, hy = rows(s[f])
+                n = hy['rows']
+            if hx['seed'] != hy['seed'] or (hx['complete'] == 1 and hy['complete'] == 1 and hx['rows'] != n):
+                raise ValueError(s[0] + " and " + s[f] + " do not match")
+            # an unfinished pair of shards is cut to the rows they both have
+            x = x[:min(hx['rows'], n)]
+            y = dense(e, hy, np.arange(x.shape[0])) if hy['content'] == DS_Y_SPARSE else y[:x.shape[0]]
+            if horizons is not None: y = labels(y, hy, horizons)
+        xs.append(x)
+        ys.append(y)
+    return np.concatenate(xs), np.concatenate(ys)
+
+def batches(m, size, horizons=None, label=None):
+    # trajectory shards are read a batch at a time from the mapping rather than loaded whole
+    if m['format'] != 'trajectory':
+        x, y = load(m, horizons, label)
+        for i in range(0, x.shape[0], size): yield x[i:i+size], y[i:i+size]
+        return
+    horizons = horizons or [1]
+    last = max(horizons)
+    for s in m['files']:
+        t = frames(s)
+        n = t.shape[2]
+        step = max(1, size // t.shape[1])
+        for i in range(0, t.shape[0] - last, step):
+            f = min(step, t.shape[0] - last - i)
+            x = np.array(t[i:i+f].reshape(-1, n*6))
+            y = np.concatenate([t[i+h:i+h+f, :, :, 0:3].reshape(-1, n*3) for h in horizons], axis=1)
+            yield x, y
+
+def balanced(m, negatives=1, seed=0, label=None):
+    # the rows of a sparse label set with a collision and negatives times as many drawn at random from those without
+    rng = np.random.default_rng(seed)
+    f = labelfile(m, label)
+    xs = []
+    ys = []
+    for s in m['files']:
+        x, hx = rows(s[0])
+        e, hy = events(s[f])
+        n = min(hx['rows'], covered(e, hy))
+        pos = np.unique(e['row'][e['row'] < n])
+        neg = np.setdiff1d(np.arange(n, dtype=np.uint64), pos)
+        neg = rng.choice(neg, min(neg.shape[0], int(pos.shape[0]*negatives)), replace=False)
+        r = np.sort(np.concatenate([pos, neg]))
+        xs.append(x[r.astype(np.int64)])
+        ys.append(dense(e, hy, r))
+    return np.concatenate(xs), np.concatenate(ys)
+
+def read(inputsize, outputsize):
+    # the whole dataset in memory, from dataset.manifest or else the raw dataset_x.dat and dataset_y.dat
+    if isfile("dataset.manifest"):
+        m = manifest()
+        if len(m['files']) == 0: raise ValueError("dataset.manifest lists no shards")
+        if m['spheres']*6 != inputsize:
+            raise ValueError("the dataset has " + str(m['spheres']) + " spheres, " + str(m['spheres']*6) + " inputs per sample rather than " + str(inputsize) + ", set SPHERES")
+        # the Y width is what the first label shard holds, every label set of every horizon the run recorded
+        if m['format'] == 'trajectory':
+            name, horizons, w = 'positions', [1], m['spheres']*3
+        else:
+            h = header(m['files'][0][1])
+            name, horizons = CONTENT.get(h['content'], str(h['content'])), h['horizons']
+            w = h['spheres']*3*len(horizons) if h['content'] == DS_Y_SPARSE else h['row_floats']
+        if w != outputsize:
+            raise ValueError("the Y rows hold " + name + " labels at horizons " + str(horizons) + ", " + str(w) + " floats per sample rather than " + str(outputsize) +
+                ", pick one label set and horizon with dataset.load(m, horizons=[...], label=...) or generate with ucc -o and -h to match")
+        x, y = load(m)
+    else:
+        x = np.fromfile("dataset_x.dat", dtype=np.float32).reshape(-1, inputsize)
+        y = np.fromfile("dataset_y.dat", dtype=np.float32).reshape(-1, outputsize)
+    if x.shape[1] != inputsize or y.shape[1] != outputsize or x.shape[0] != y.shape[0]:
+        raise ValueError("the dataset does not have " + str(inputsize) + " inputs and " + str(outputsize) + " outputs per sample, set SPHERES")
+    return x, y
+
+if __name__ == '__main__':
+    m = manifest()
+    bad = 0
+    for s in m['files']:
+        for file in s[:-1]:
+            r = verify(file)
+            print(file, "ok" if r == 0 else ("no index" if r < 0 else str(r) + " bad blocks"))
+            if r != 0: bad += 1
+    if len(sys.argv) >= 2 and sys.argv[1] == 'cat':
+        x, y = load(m)
+        x.tofile("dataset_x.dat")
+        y.tofile("dataset_y.dat")
+        print("Wrote", "{:,}".format(x.shape[0]), "samples to dataset_x.dat and dataset_y.dat")
+    sys.exit(1 if bad > 0 else 0)
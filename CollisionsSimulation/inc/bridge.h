@@ -0,0 +1,191 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Shared memory bridge between uc and the predictor (pred.py).
+
+    /dev/shm/uc_bridge holds two single producer single consumer rings,
+    requests from uc to the predictor and responses back. Each side
+    only ever writes the slots it owns and then publishes them by
+    advancing a head counter with release ordering, the other side
+    copies a slot out before advancing its tail, so a slot is never
+    read while it is being written and a prediction can never be torn.
+
+    A consumer with nothing to read sleeps in futex() on the head
+    counter and the producer wakes it straight after publishing, no
+    polling and no delay.
+
+    Every request carries an id and its response carries the same id,
+    so uc can either block until the prediction for this very step
+    arrives (bridgeWait) or take the newest prediction available and
+    carry on (bridgeLatest). The predictor always skips to the newest
+    request so it never works through a backlog.
+
+    All the ring state is in the shared memory, so either side can be
+    restarted and pick up where the counters are. bridge.py is the
+    Python side and must match this layout.
+
+    Requires Linux (futex)
+*/
+
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define BRIDGE_MAGIC 0x42524355 // "UCRB"
+#define BRIDGE_VERSION 1
+#define BRIDGE_SLOTS 8
+
+typedef struct
+{
+    uint32_t magic, version;
+    uint32_t in_floats, out_floats; // per request and per response
+    uint32_t slots;
+    uint32_t slot_in, slot_out;     // bytes per slot of each ring
+    uint8_t pad0[36];
+    uint32_t req_head;  uint8_t pad1[60]; // written by uc
+    uint32_t req_tail;  uint8_t pad2[60]; // written by the predictor
+    uint32_t resp_head; uint8_t pad3[60]; // written by the predictor
+    uint32_t resp_tail; uint8_t pad4[60]; // written by uc
+} bridgehdr; // followed by the request slots and then the response slots, each slot is uint32 id, 12 bytes pad, floats
+_Static_assert(sizeof(bridgehdr) == 320, "bridgehdr is 320 bytes");
+
+typedef struct
+{
+    bridgehdr* h;
+    size_t bytes;
+    char* req;           // request slots
+    char* resp;          // response slots
+    uint32_t last;       // id of the last response taken
+} bridge;
+
+int  bridgeOpen(bridge* b, const char* name, const unsigned int in_floats, const unsigned int out_floats); // name as for shm_open, "/uc_bridge"
+void bridgeClose(bridge* b);
+int64_t bridgeSend(bridge* b, const float* in); // returns the request id, -1 if the predictor is not keeping up
+int  bridgeWait(bridge* b, const uint32_t id, float* out, const int timeout_ms); // 1 if the response to id arrived in time
+int  bridgeLatest(bridge* b, float* out); // 1 if there was a response newer than the last one taken
+
+//
+
+static void bridgeWake(uint32_t* w)
+{
+    syscall(SYS_futex, w, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+static void bridgeSleep(uint32_t* w, const uint32_t v, const struct timespec* ts)
+{
+    syscall(SYS_futex, w, FUTEX_WAIT, v, ts, NULL, 0);
+}
+
+int bridgeOpen(bridge* b, const char* name, const unsigned int in_floats, const unsigned int out_floats)
+{
+    memset(b, 0, sizeof(bridge));
+    const uint32_t slot_in = (16 + in_floats*4 + 63) & ~63;
+    const uint32_t slot_out = (16 + out_floats*4 + 63) & ~63;
+    b->bytes = sizeof(bridgehdr) + BRIDGE_SLOTS*(slot_in + slot_out);
+
+    const int fd = shm_open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if(fd < 0){return -1;}
+    if(ftruncate(fd, b->bytes) < 0){close(fd); return -1;}
+    void* p = mmap(NULL, b->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED){return -1;}
+    b->h = p;
+    b->req = (char*)p + sizeof(bridgehdr);
+    b->resp = b->req + BRIDGE_SLOTS*slot_in;
+
+    // keep the counters of a bridge that is already set up for these sizes, a running predictor carries on
+    bridgehdr* h = b->h;
+    if(__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != BRIDGE_MAGIC || h->version != BRIDGE_VERSION ||
+        h->in_floats != in_floats || h->out_floats != out_floats || h->slots != BRIDGE_SLOTS)
+    {
+        __atomic_store_n(&h->magic, 0, __ATOMIC_RELEASE);
+        h->version = BRIDGE_VERSION;
+        h->in_floats = in_floats;
+        h->out_floats = out_floats;
+        h->slots = BRIDGE_SLOTS;
+        h->slot_in = slot_in;
+        h->slot_out = slot_out;
+        h->req_head = h->req_tail = h->resp_head = h->resp_tail = 0;
+        __atomic_store_n(&h->magic, BRIDGE_MAGIC, __ATOMIC_RELEASE);
+    }
+    b->last = h->req_head;
+    return 0;
+}
+
+void bridgeClose(bridge* b)
+{
+    if(b->h != NULL){munmap(b->h, b->bytes);}
+    b->h = NULL;
+}
+
+int64_t bridgeSend(bridge* b, const float* in)
+{
+    bridgehdr* h = b->h;
+    const uint32_t head = h->req_head;
+    if(head - __atomic_load_n(&h->req_tail, __ATOMIC_ACQUIRE) >= h->slots){return -1;}
+    char* s = b->req + (head % h->slots)*h->slot_in;
+    *(uint32_t*)s = head;
+    memcpy(s + 16, in, h->in_floats*sizeof(float));
+    __atomic_store_n(&h->req_head, head + 1, __ATOMIC_RELEASE);
+    bridgeWake(&h->req_head);
+    return head;
+}
+
+// copy out every published response, out ends up with the newest, returns its id or -1 if there were none
+static int64_t bridgeDrain(bridge* b, float* out)
+{
+    bridgehdr* h = b->h;
+    uint32_t tail = h->resp_tail;
+    const uint32_t head = __atomic_load_n(&h->resp_head, __ATOMIC_ACQUIRE);
+    if(tail == head){return -1;}
+    tail = head - 1; // only the newest is of any use
+    const char* s = b->resp + (tail % h->slots)*h->slot_out;
+    const uint32_t id = *(const uint32_t*)s;
+    memcpy(out, s + 16, h->out_floats*sizeof(float));
+    __atomic_store_n(&h->resp_tail, head, __ATOMIC_RELEASE);
+    return id;
+}
+
+int bridgeWait(bridge* b, const uint32_t id, float* out, const int timeout_ms)
+{
+    bridgehdr* h = b->h;
+    struct timespec end, now;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += timeout_ms / 1000;
+    end.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(end.tv_nsec >= 1000000000L){end.tv_sec++; end.tv_nsec -= 1000000000L;}
+    while(1)
+    {
+        const uint32_t head = __atomic_load_n(&h->resp_head, __ATOMIC_ACQUIRE);
+        const int64_t r = bridgeDrain(b, out);
+        if(r >= 0){b->last = r;}
+        if(r == id){return 1;}
+        if(r >= 0 && (int32_t)(r - id) > 0){return 0;} // a newer request was answered, this one was skipped
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct timespec left = {end.tv_sec - now.tv_sec, end.tv_nsec - now.tv_nsec};
+        if(left.tv_nsec < 0){left.tv_sec--; left.tv_nsec += 1000000000L;}
+        if(left.tv_sec < 0){return 0;}
+        bridgeSleep(&h->resp_head, head, &left);
+    }
+}
+
+int bridgeLatest(bridge* b, float* out)
+{
+    const int64_t r = bridgeDrain(b, out);
+    if(r < 0){return 0;}
+    b->last = r;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,358 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Event driven engine for the unit sphere collider.
+
+    Instead of moving every sphere by SPHERE_SPEED each step and
+    pushing apart whatever overlaps afterwards this solves for the
+    exact time each sphere next touches the wall or another sphere,
+    keeps those times in a binary heap and only does work at events.
+    Spheres move in straight lines between events so a state at any
+    time is just an extrapolation, evStep() processes the events up
+    to the next whole step and writes the state at that time into
+    the sim so the generator records it the same as any other step.
+
+    Time is measured in steps and a sphere moves dir*speed per step.
+    Positions and times are kept in double as a sphere is only
+    brought up to date when it takes part in an event.
+
+    Each sphere only ever has its soonest event in the heap. Every
+    event carries the collision counts of its spheres when it was
+    predicted, so an event is stale if its own sphere has changed
+    since, and if only the partner has changed the sphere predicts
+    again from that time. A sphere that changes predicts against
+    every other sphere so nothing it could now hit is missed.
+
+    Responses keep every sphere at SPHERE_SPEED as the stepped model
+    does. Off the wall the direction is mirrored about the wall
+    normal exactly as simMoveWall() does, and when two spheres touch
+    each one moving into the contact plane is mirrored off it, they
+    always leave separating. Nothing ever overlaps or leaves the unit
+    sphere so there is no push out term, no tunnelling at any speed
+    and no step where a sphere is inside another. This is a different
+    model from sim_step(), the trajectories will not match it.
+
+    simRandom() does not prevent spheres starting inside each other
+    so evSync() first pushes overlapping pairs apart, up to
+    EV_RELAX passes, and writes the corrected state back to the sim.
+    If they still overlap after that the spheres are too big or too
+    many to fit (hard spheres can fill at most 74% of the volume) and
+    evInit() and evSync() return 1, stepping anyway is allowed and
+    a pair that is still overlapping collides at once if approaching
+    and otherwise drifts apart, but such a packing can jam.
+
+    Each prediction is O(N) so an event costs O(N) and the work per
+    step is proportional to the collisions in it, at low densities
+    most steps have none and cost only writing out the state.
+
+    Requires sim.h
+*/
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "sim.h"
+
+#define EV_WALL 0xFFFFFFFFu  // partner of a wall event
+#define EV_TOL 1e-9          // relative tolerance for approaching and leaving
+#define EV_MAX_EVENTS 4096   // per sphere per step, guards against a sphere trapped in a zero time loop
+#define EV_RELAX 1024         // passes separating overlapping starting states
+#define EV_GAP 1e-6          // relative gap left between spheres separated at the start
+#define EV_NEVER 1e300       // time of an event that will not happen, not INFINITY as the viewer builds with -Ofast
+
+typedef struct
+{
+    double t;                // when
+    uint32_t a, b;           // sphere and its partner, EV_WALL for the wall
+    uint32_t ca, cb;         // their collision counts when predicted
+} evevent;
+
+typedef struct
+{
+    sim* s;                  // states are written here at each step
+    double now;              // current time, the end of the last step between calls
+    double *px, *py, *pz;    // position at t
+    double *dx, *dy, *dz;    // unit direction
+    double *t;               // time each sphere was last brought up to date
+    uint32_t* count;         // collisions each sphere has had, stale events do not match
+    evevent* heap;
+    size_t heap_len, heap_cap;
+    uint64_t events;         // processed
+    uint64_t tests;          // pair times solved, for the benchmark
+} simevent;
+
+int  evInit(simevent* e, sim* s); // starts from the current state of s at time 0, -1 if out of memory, else as evSync()
+void evFree(simevent* e);
+int  evSync(simevent* e); // the state of s was changed from outside, start again from it, 1 if spheres are left overlapping
+void evStep(simevent* e, unsigned char* hit); // advance one step, hit[i] = 1 if sphere i touched another in it
+
+//
+
+int evInit(simevent* e, sim* s)
+{
+    memset(e, 0, sizeof(simevent));
+    e->s = s;
+    double** a[7] = {&e->px, &e->py, &e->pz, &e->dx, &e->dy, &e->dz, &e->t};
+    for(int k = 0; k < 7; k++)
+    {
+        *a[k] = malloc(s->n * sizeof(double));
+        if(*a[k] == NULL){evFree(e); return -1;}
+    }
+    e->count = malloc(s->n * sizeof(uint32_t));
+    e->heap_cap = s->n*2 + 16;
+    e->heap = malloc(e->heap_cap * sizeof(evevent));
+    if(e->count == NULL || e->heap == NULL){evFree(e); return -1;}
+    return evSync(e);
+}
+
+void evFree(simevent* e)
+{
+    free(e->px); free(e->py); free(e->pz);
+    free(e->dx); free(e->dy); free(e->dz);
+    free(e->t); free(e->count); free(e->heap);
+    memset(e, 0, sizeof(simevent));
+}
+
+//*************************************
+// heap
+//*************************************
+
+static void evPush(simevent* e, const evevent v)
+{
+    if(e->heap_len == e->heap_cap)
+    {
+        evevent* h = realloc(e->heap, e->heap_cap*2 * sizeof(evevent));
+        if(h == NULL){return;} // the sphere predicts again when its partner next changes
+        e->heap = h;
+        e->heap_cap *= 2;
+    }
+    size_t i = e->heap_len++;
+    while(i > 0 && e->heap[(i-1)/2].t > v.t)
+    {
+        e->heap[i] = e->heap[(i-1)/2];
+        i = (i-1)/2;
+    }
+    e->heap[i] = v;
+}
+
+static evevent evPop(simevent* e)
+{
+    const evevent top = e->heap[0];
+    const evevent last = e->heap[--e->heap_len];
+    size_t i = 0;
+    while(1)
+    {
+        size_t c = i*2 + 1;
+        if(c >= e->heap_len){break;}
+        if(c+1 < e->heap_len && e->heap[c+1].t < e->heap[c].t){c++;}
+        if(e->heap[c].t >= last.t){break;}
+        e->heap[i] = e->heap[c];
+        i = c;
+    }
+    e->heap[i] = last;
+    return top;
+}
+
+//*************************************
+// prediction
+//*************************************
+
+// position of sphere i at time t
+static inline void evAt(const simevent* e, const unsigned int i, const double t, double* x, double* y, double* z)
+{
+    const double m = (t - e->t[i]) * e->s->speed;
+    *x = e->px[i] + e->dx[i]*m;
+    *y = e->py[i] + e->dy[i]*m;
+    *z = e->pz[i] + e->dz[i]*m;
+}
+
+// steps from now until sphere i at x,y,z next meets the wall
+static double evWallTime(const simevent* e, const unsigned int i, const double x, const double y, const double z)
+{
+    const double sp = e->s->speed;
+    const double vx = e->dx[i]*sp, vy = e->dy[i]*sp, vz = e->dz[i]*sp;
+    const double a = vx*vx + vy*vy + vz*vz;
+    if(a == 0.0){return EV_NEVER;}
+    const double b = x*vx + y*vy + z*vz;
+    const double c = x*x + y*y + z*z - 1.0;
+    if(c >= 0.0 && b > EV_TOL*sqrt(a)){return 0.0;} // on or outside and heading out
+    const double disc = b*b - a*c;
+    if(disc < 0.0){return EV_NEVER;}
+    const double t = (-b + sqrt(disc)) / a; // the far root, where it leaves
+    return t > 0.0 ? t : 0.0;
+}
+
+// steps from now until spheres i and j at their positions now first touch
+static double evPairTime(const simevent* e, const unsigned int i, const unsigned int j, const double cd2)
+{
+    double ix, iy, iz, jx, jy, jz;
+    evAt(e, i, e->now, &ix, &iy, &iz);
+    evAt(e, j, e->now, &jx, &jy, &jz);
+    const double sp = e->s->speed;
+    const double rx = jx-ix, ry = jy-iy, rz = jz-iz;
+    const double vx = (e->dx[j]-e->dx[i])*sp, vy = (e->dy[j]-e->dy[i])*sp, vz = (e->dz[j]-e->dz[i])*sp;
+    const double b = rx*vx + ry*vy + rz*vz;
+    const double a = vx*vx + vy*vy + vz*vz;
+    if(!(b < -EV_TOL*sqrt(a*(rx*rx + ry*ry + rz*rz)))){return EV_NEVER;} // not approaching
+    const double c = rx*rx + ry*ry + rz*rz - cd2;
+    if(c <= 0.0){return 0.0;} // already overlapping and approaching
+    const double disc = b*b - a*c;
+    if(disc <= 0.0){return EV_NEVER;} // they pass by
+    return c / (-b + sqrt(disc)); // the near root without cancellation
+}
+
+// push the soonest event of sphere i from now
+static void evPredict(simevent* e, const unsigned int i)
+{
+    const double cd = e->s->scale*1.8f;
+    const double cd2 = cd*cd;
+    double x, y, z;
+    evAt(e, i, e->now, &x, &y, &z);
+
+    evevent v = {e->now + evWallTime(e, i, x, y, z), i, EV_WALL, e->count[i], 0};
+    for(unsigned int j = 0; j < e->s->n; j++)
+    {
+        if(j == i){continue;}
+        const double t = e->now + evPairTime(e, i, j, cd2);
+        if(t < v.t)
+        {
+            v.t = t;
+            v.b = j;
+            v.cb = e->count[j];
+        }
+    }
+    e->tests += e->s->n - 1;
+    if(v.t < EV_NEVER){evPush(e, v);}
+}
+
+//*************************************
+// events
+//*************************************
+
+// bring sphere i up to time t
+static inline void evMove(simevent* e, const unsigned int i, const double t)
+{
+    evAt(e, i, t, &e->px[i], &e->py[i], &e->pz[i]);
+    e->t[i] = t;
+}
+
+// mirror the direction of sphere i about the plane with normal n if it is moving along n
+static inline void evMirror(simevent* e, const unsigned int i, const double nx, const double ny, const double nz, const int always)
+{
+    const double dn = e->dx[i]*nx + e->dy[i]*ny + e->dz[i]*nz;
+    if(always == 0 && dn <= 0.0){return;}
+    e->dx[i] -= 2.0*dn*nx;
+    e->dy[i] -= 2.0*dn*ny;
+    e->dz[i] -= 2.0*dn*nz;
+    const double l = 1.0 / sqrt(e->dx[i]*e->dx[i] + e->dy[i]*e->dy[i] + e->dz[i]*e->dz[i]);
+    e->dx[i] *= l, e->dy[i] *= l, e->dz[i] *= l;
+}
+
+// push overlapping spheres apart along the line between them and keep them inside the wall, 1 if none were left
+static int evRelax(simevent* e)
+{
+    const double cd = e->s->scale*1.8f;
+    int clear = 1;
+    for(unsigned int i = 0; i < e->s->n; i++)
+    {
+        for(unsigned int j = i+1; j < e->s->n; j++)
+        {
+            const double rx = e->px[j]-e->px[i], ry = e->py[j]-e->py[i], rz = e->pz[j]-e->pz[i];
+            const double d = sqrt(rx*rx + ry*ry + rz*rz);
+            if(d >= cd || d == 0.0){continue;}
+            const double m = (cd*(1.0 + EV_GAP) - d)*0.5 / d; // a little past touching so rounding does not leave them overlapping
+            e->px[i] -= rx*m, e->py[i] -= ry*m, e->pz[i] -= rz*m;
+            e->px[j] += rx*m, e->py[j] += ry*m, e->pz[j] += rz*m;
+            clear = 0;
+        }
+    }
+    for(unsigned int i = 0; i < e->s->n; i++)
+    {
+        const double r = sqrt(e->px[i]*e->px[i] + e->py[i]*e->py[i] + e->pz[i]*e->pz[i]);
+        if(r > 1.0){e->px[i] /= r, e->py[i] /= r, e->pz[i] /= r;}
+    }
+    return clear;
+}
+
+int evSync(simevent* e)
+{
+    sim* s = e->s;
+    e->now = 0.0;
+    e->heap_len = 0;
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        e->px[i] = s->x[i], e->py[i] = s->y[i], e->pz[i] = s->z[i];
+        e->dx[i] = s->dx[i], e->dy[i] = s->dy[i], e->dz[i] = s->dz[i];
+        e->t[i] = 0.0;
+        e->count[i] = 0;
+    }
+    int clear = 0;
+    for(int k = 0; k < EV_RELAX && clear == 0; k++){clear = evRelax(e);}
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        s->x[i] = e->px[i], s->y[i] = e->py[i], s->z[i] = e->pz[i];
+        evPredict(e, i);
+    }
+    return 1 - clear;
+}
+
+void evStep(simevent* e, unsigned char* hit)
+{
+    sim* s = e->s;
+    const double end = e->now + 1.0;
+    if(hit != NULL){memset(hit, 0, s->n);}
+
+    uint64_t budget = (uint64_t)s->n * EV_MAX_EVENTS;
+    while(e->heap_len > 0 && e->heap[0].t <= end && budget-- > 0)
+    {
+        const evevent v = evPop(e);
+        if(v.ca != e->count[v.a]){continue;} // the sphere has a newer prediction
+        e->now = v.t;
+        if(v.b != EV_WALL && v.cb != e->count[v.b])
+        {
+            // only the partner changed course, find the sphere's next event from here
+            evPredict(e, v.a);
+            continue;
+        }
+
+        evMove(e, v.a, v.t);
+        if(v.b == EV_WALL)
+        {
+            const double l = 1.0 / sqrt(e->px[v.a]*e->px[v.a] + e->py[v.a]*e->py[v.a] + e->pz[v.a]*e->pz[v.a]);
+            evMirror(e, v.a, e->px[v.a]*l, e->py[v.a]*l, e->pz[v.a]*l, 1);
+            e->count[v.a]++;
+            evPredict(e, v.a);
+        }
+        else
+        {
+            evMove(e, v.b, v.t);
+            const double nx = e->px[v.b]-e->px[v.a], ny = e->py[v.b]-e->py[v.a], nz = e->pz[v.b]-e->pz[v.a];
+            const double l = 1.0 / sqrt(nx*nx + ny*ny + nz*nz);
+            evMirror(e, v.a, nx*l, ny*l, nz*l, 0);
+            evMirror(e, v.b, -nx*l, -ny*l, -nz*l, 0);
+            e->count[v.a]++;
+            e->count[v.b]++;
+            if(hit != NULL){hit[v.a] = hit[v.b] = 1;}
+            if(s->partner != NULL){s->partner[v.a] = simId(s, v.b), s->partner[v.b] = simId(s, v.a);}
+            evPredict(e, v.a);
+            evPredict(e, v.b);
+        }
+        e->events++;
+    }
+
+    // state at the end of the step
+    e->now = end;
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        double x, y, z;
+        evAt(e, i, end, &x, &y, &z);
+        s->x[i] = x, s->y[i] = y, s->z[i] = z;
+        s->dx[i] = e->dx[i], s->dy[i] = e->dy[i], s->dz[i] = e->dz[i];
+    }
+}
+
+#endif
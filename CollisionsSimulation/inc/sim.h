@@ -0,0 +1,1431 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Structure-of-arrays sphere state and step kernels for the
+    unit sphere collider.
+
+    The ordered kernels match sim_step(), the scalar reference, bit
+    for bit: sim_step_avx2(), sim_step_mask() up to SIM_MASK_MAX
+    spheres, sim_step_grid() and sim_step_verlet(), and simSelectStep()
+    picks the fastest for a sphere count. sim_step_pairs() and its avx2
+    and grid versions are a second model that resolves each pair once
+    and does not depend on the sphere order, so simReorder() can sort
+    the spheres into Morton order for them. sim_advance() takes k steps
+    at once, jumping spheres in free flight to the last step each pair
+    can not meet by and stepping the rest with the kernel it is given.
+    It is not bit-for-bit with stepping, and it keeps an n*n table of
+    pair bounds, so it is only for small sphere counts.
+
+    Requires vec.h
+*/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "vec.h"
+#include "philox.h"
+
+#define SIM_LANES 8          // floats per AVX2 register, arrays are padded to this
+#define SIM_PAD_POS 8.f      // padding lanes sit far outside the unit sphere
+#define SIM_GRID_MIN 256     // simSelectStep() prefers the grid from this many spheres
+#define SIM_MASK_MAX 32      // sim_step_mask() sphere limit, one bit per partner
+#define SIM_GRID_MAX_DIM 128 // cells per axis
+#define SIM_VERLET_STEPS 8   // steps of movement at SPHERE_SPEED either side, sets the skin
+#define SIM_VERLET_LOOSE 16  // loose spheres allowed before a rebuild, or one in 64 spheres if more
+#define SIM_PAIR_FIX 1099511627776.f // 2^40, scale of the fixed point contact sums
+#define SIM_MORTON_BITS 10   // per axis, 1024 cells across the cube
+
+typedef struct
+{
+    int *head;          // first sphere in each cell, -1 if empty
+    int *next, *prev;   // doubly linked list of the spheres in a cell
+    int *cell;          // cell each sphere is filed in, -1 if none
+    unsigned int *cand; // candidate scratch buffer
+    unsigned int dim;   // cells per axis
+    float inv;          // 1 / cell size
+    uint64_t tests;     // pair distances tested by the last step, for the benchmark
+} simgrid;
+
+typedef struct
+{
+    unsigned int *start;   // neighbours of sphere i are list[start[i]] to list[start[i+1]-1], sorted by index
+    unsigned int *list;
+    size_t cap;
+    float *bx, *by, *bz;   // positions at the last build
+    float skin;
+    int stale;             // 1 = rebuild before the next step
+    unsigned int age;      // steps since the build
+    unsigned int* loose;   // spheres moved over half the skin since the build, sorted by index
+    unsigned int nloose, maxloose;
+    unsigned char* isloose;
+    unsigned int* cand;    // candidate scratch buffer
+    simgrid grid;          // cells of the collision distance plus skin for building from SIM_GRID_MIN spheres
+    uint64_t builds;       // for the benchmark
+    uint64_t tests;        // pair distances tested by the last step, for the benchmark
+} simverlet;
+
+typedef struct
+{
+    unsigned int *t;     // the step each sphere has been moved to, a sphere out of reach of every other is only moved when it is needed
+    unsigned int *wall;  // the last step of free flight of each sphere before it bounces
+    unsigned int *pair;  // n*n, pair[i*n+j] is the last step spheres i and j can not meet by
+    unsigned int *near;  // least pair bound of each sphere, or less
+    unsigned int *act;   // the spheres with a pair in reach, in index order
+    unsigned char *out;  // 1 if outside the unit sphere
+    unsigned char *hits; // collisions of one step
+    vec *pos, *dir;      // the step of the spheres in reach before it is kept
+} simflight;
+
+typedef struct
+{
+    float *x, *y, *z;    // position
+    float *dx, *dy, *dz; // direction
+    unsigned int n;      // number of spheres
+    unsigned int np;     // n padded to SIM_LANES
+    float scale;         // SPHERE_SCALE
+    float speed;         // SPHERE_SPEED
+    simgrid grid;        // broad phase for sim_step_grid(), allocated on first use
+    simverlet verlet;    // neighbour lists for sim_step_verlet(), allocated on first use
+    int64_t *cx, *cy, *cz; // contact sums of reflected directions for sim_step_pairs()
+    float *pen;          // deepest overlap of each sphere this step, 0 if none
+    unsigned int *id;    // sphere id in each slot after simReorder(), NULL while in id order
+    unsigned int *slot;  // slot of each sphere id
+    int *partner;        // id of the sphere each slot last collided with, only written on a collision, NULL to not record, owned by the caller
+    simflight flight;    // pair bounds for sim_advance(), allocated on first use
+    uint64_t tests;      // pair distances tested by the last step of the avx2 and mask kernels, every lane, for the benchmark
+} sim;
+
+int  simInit(sim* s, const unsigned int n, const float scale, const float speed);
+void simFree(sim* s);
+void simRandom(sim* s); // random positions inside and directions of the unit sphere
+void simRandomStream(sim* s, const uint64_t seed, const uint64_t stream); // the same from philox.h, thread safe and reproducible
+void simGet(const sim* s, const unsigned int i, vec* pos, vec* dir);
+void simSet(sim* s, const unsigned int i, const vec pos, const vec dir);
+int  simCopy(sim* r, const sim* s); // also copies the order, r must have the same n, -1 if out of memory
+int  simEqual(const sim* a, const sim* b); // bit-for-bit, sphere by sphere id whatever the order
+
+// i above is a slot, the same as the sphere id until the arrays are reordered
+int  simReorder(sim* s); // Morton order, -1 if out of memory and the order is unchanged
+static inline unsigned int simSlot(const sim* s, const unsigned int id){return s->slot == NULL ? id : s->slot[id];}
+static inline unsigned int simId(const sim* s, const unsigned int i){return s->id == NULL ? i : s->id[i];}
+
+// hit[i] is set to 1 if sphere i collided with another sphere this step, hit may be NULL
+void sim_step(sim* s, unsigned char* hit);
+#ifndef NOSSE
+void sim_step_avx2(sim* s, unsigned char* hit);
+void sim_step_mask(sim* s, unsigned char* hit); // more than SIM_MASK_MAX spheres falls back to sim_step_avx2()
+#endif
+void sim_step_grid(sim* s, unsigned char* hit);
+void sim_step_verlet(sim* s, unsigned char* hit);
+
+int  simGridInit(sim* s);
+void simGridBuild(sim* s); // re-file every sphere, called at the start of each grid step
+
+// symmetric once-per-pair resolution, all three give identical results
+void sim_step_pairs(sim* s, unsigned char* hit);
+#ifndef NOSSE
+void sim_step_pairs_avx2(sim* s, unsigned char* hit);
+#endif
+void sim_step_pairs_grid(sim* s, unsigned char* hit);
+
+typedef void (*sim_step_fn)(sim*, unsigned char*);
+sim_step_fn simSelectStep(const unsigned int n); // fastest kernel the cpu supports for n spheres, it may only step sims of n spheres
+sim_step_fn simSelectPairs(const unsigned int n); // as simSelectStep() for the pair kernels
+
+// k steps of the model, free flight is jumped over and step() takes the rest, hit[i] is 1 if sphere i collided in any of them, returns the steps no sphere was in reach of another
+unsigned int sim_advance(sim* s, const unsigned int k, sim_step_fn step, unsigned char* hit);
+
+//
+
+static void simGridFree(simgrid* g);
+static void simVerletFree(simverlet* v);
+static void simFlightFree(simflight* f);
+
+int simInit(sim* s, const unsigned int n, const float scale, const float speed)
+{
+    memset(s, 0, sizeof(sim));
+    s->n = n;
+    s->np = (n + SIM_LANES-1) & ~(SIM_LANES-1);
+    s->scale = scale;
+    s->speed = speed;
+    const size_t bytes = s->np * sizeof(float);
+    float** a[6] = {&s->x, &s->y, &s->z, &s->dx, &s->dy, &s->dz};
+    for(int k = 0; k < 6; k++)
+    {
+        *a[k] = aligned_alloc(32, bytes);
+        if(*a[k] == NULL){simFree(s); return -1;}
+        for(unsigned int i = 0; i < s->np; i++)
+            (*a[k])[i] = k < 3 ? SIM_PAD_POS : 0.f;
+    }
+    s->cx = aligned_alloc(32, s->np * sizeof(int64_t));
+    s->cy = aligned_alloc(32, s->np * sizeof(int64_t));
+    s->cz = aligned_alloc(32, s->np * sizeof(int64_t));
+    s->pen = aligned_alloc(32, bytes);
+    if(s->cx == NULL || s->cy == NULL || s->cz == NULL || s->pen == NULL){simFree(s); return -1;}
+    return 0;
+}
+
+void simFree(sim* s)
+{
+    free(s->x);  free(s->y);  free(s->z);
+    free(s->dx); free(s->dy); free(s->dz);
+    s->x = s->y = s->z = s->dx = s->dy = s->dz = NULL;
+    free(s->cx); free(s->cy); free(s->cz); free(s->pen);
+    s->cx = s->cy = s->cz = NULL;
+    s->pen = NULL;
+    free(s->id); free(s->slot);
+    s->id = s->slot = NULL;
+
+    simGridFree(&s->grid);
+    simVerletFree(&s->verlet);
+    simFlightFree(&s->flight);
+}
+
+void simRandom(sim* s)
+{
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        vec pos, dir;
+        vRuvTA(&pos); // random point on inside of unit sphere
+#ifdef VEC_STRICT
+        // libm acosf() sinf() cosf() differ between machines, a direction from inside the sphere only needs + * and sqrt
+        do{vRuvTA(&dir);}while(dir.x == 0.f && dir.y == 0.f && dir.z == 0.f);
+#else
+        vRuvBT(&dir); // random point on outside of unit sphere
+#endif
+        vNorm(&dir);
+        simSet(s, i, pos, dir);
+    }
+    s->verlet.stale = 1; // positions set from outside the step invalidate the lists
+}
+
+void simRandomStream(sim* s, const uint64_t seed, const uint64_t stream)
+{
+    philox p;
+    pxSeed(&p, seed, stream);
+    pxBall(&p, s->x, s->y, s->z, s->n);
+    pxRuv(&p, s->dx, s->dy, s->dz, s->n);
+    s->verlet.stale = 1;
+}
+
+void simGet(const sim* s, const unsigned int i, vec* pos, vec* dir)
+{
+    pos->x = s->x[i],  pos->y = s->y[i],  pos->z = s->z[i],  pos->w = 0.f;
+    dir->x = s->dx[i], dir->y = s->dy[i], dir->z = s->dz[i], dir->w = 0.f;
+}
+
+void simSet(sim* s, const unsigned int i, const vec pos, const vec dir)
+{
+    s->x[i]  = pos.x, s->y[i]  = pos.y, s->z[i]  = pos.z;
+    s->dx[i] = dir.x, s->dy[i] = dir.y, s->dz[i] = dir.z;
+}
+
+int simCopy(sim* r, const sim* s)
+{
+    const size_t bytes = s->np * sizeof(float);
+    memcpy(r->x,  s->x,  bytes);
+    memcpy(r->y,  s->y,  bytes);
+    memcpy(r->z,  s->z,  bytes);
+    memcpy(r->dx, s->dx, bytes);
+    memcpy(r->dy, s->dy, bytes);
+    memcpy(r->dz, s->dz, bytes);
+    r->verlet.stale = 1;
+
+    if(s->id == NULL)
+    {
+        free(r->id); free(r->slot);
+        r->id = r->slot = NULL;
+        return 0;
+    }
+    if(r->id == NULL)
+    {
+        r->id = malloc(s->n * sizeof(unsigned int));
+        r->slot = malloc(s->n * sizeof(unsigned int));
+        if(r->id == NULL || r->slot == NULL)
+        {
+            free(r->id); free(r->slot);
+            r->id = r->slot = NULL;
+            return -1;
+        }
+    }
+    memcpy(r->id, s->id, s->n * sizeof(unsigned int));
+    memcpy(r->slot, s->slot, s->n * sizeof(unsigned int));
+    return 0;
+}
+
+int simEqual(const sim* a, const sim* b)
+{
+    if(a->n != b->n){return 0;}
+    if(a->id != NULL || b->id != NULL)
+    {
+        const float* fa[6] = {a->x, a->y, a->z, a->dx, a->dy, a->dz};
+        const float* fb[6] = {b->x, b->y, b->z, b->dx, b->dy, b->dz};
+        for(unsigned int i = 0; i < a->n; i++)
+        {
+            const unsigned int sa = simSlot(a, i), sb = simSlot(b, i);
+            for(int k = 0; k < 6; k++)
+                if(memcmp(&fa[k][sa], &fb[k][sb], sizeof(float)) != 0)
+                    return 0;
+        }
+        return 1;
+    }
+    const size_t bytes = a->n * sizeof(float);
+    return  a->n == b->n &&
+            memcmp(a->x,  b->x,  bytes) == 0 &&
+            memcmp(a->y,  b->y,  bytes) == 0 &&
+            memcmp(a->z,  b->z,  bytes) == 0 &&
+            memcmp(a->dx, b->dx, bytes) == 0 &&
+            memcmp(a->dy, b->dy, bytes) == 0 &&
+            memcmp(a->dz, b->dz, bytes) == 0;
+}
+
+// move sphere i by its direction and reflect it off the inside of the unit sphere
+static inline void simMoveWall(const sim* s, vec* pos, vec* dir)
+{
+    vec inc;
+    vMulS(&inc, *dir, s->speed);
+    vAdd(pos, *pos, inc);
+
+    const float mod = vMod(*pos);
+    if(mod > 1.f)
+    {
+        vec sd = *pos;
+        vNorm(&sd);
+
+        vReflect(dir, *dir, sd);
+        vNorm(dir);
+
+        vec ob = *pos;
+        vNorm(&ob);
+        vInv(&ob);
+
+        vMulS(&inc, ob, (mod-1.f)+s->speed);
+        vAdd(pos, *pos, inc);
+    }
+}
+
+// reflect sphere i off sphere j which is at distance d
+static inline void simCollide(const sim* s, const unsigned int i, const unsigned int j, const float d, const float cd, vec* pos, vec* dir)
+{
+    if(s->partner != NULL){s->partner[i] = simId(s, j);}
+    const vec dj = {s->dx[j], s->dy[j], s->dz[j], 0.f};
+
+    // reflect the ball direction
+    vReflect(dir, dj, *dir);
+    vNorm(dir);
+
+    // increment the ball to a non-intersecting distance in the new direction
+    vec inc;
+    vMulS(&inc, *dir, (cd-d)+s->speed);
+    vAdd(pos, *pos, inc);
+}
+
+// the same floating-point operations in the same order as the original array-of-structs loop
+void sim_step(sim* s, unsigned char* hit)
+{
+    const float cd = s->scale*1.8f;
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        vec pos, dir;
+        simGet(s, i, &pos, &dir);
+        simMoveWall(s, &pos, &dir);
+
+        unsigned char h = 0;
+        for(unsigned int j = 0; j < s->n; j++)
+        {
+            if(j == i){continue;} // dont collide with self
+
+            const vec pj = {s->x[j], s->y[j], s->z[j], 0.f};
+            const float d = vDist(pos, pj);
+            if(d < cd)
+            {
+                simCollide(s, i, j, d, cd, &pos, &dir);
+                h = 1;
+            }
+        }
+
+        simSet(s, i, pos, dir);
+        if(hit != NULL){hit[i] = h;}
+    }
+}
+
+//*************************************
+// uniform grid broad phase
+//*************************************
+
+static void simGridFree(simgrid* g)
+{
+    free(g->head); free(g->next); free(g->prev);
+    free(g->cell); free(g->cand);
+    memset(g, 0, sizeof(simgrid));
+}
+
+// cells at least cell wide for n spheres
+static int simGridAlloc(simgrid* g, const unsigned int n, const float cell)
+{
+    // the small margin covers rounding when mapping positions to cells
+    unsigned int dim = (unsigned int)(2.f / (cell*1.001f));
+    if(dim < 1){dim = 1;}
+    if(dim > SIM_GRID_MAX_DIM){dim = SIM_GRID_MAX_DIM;}
+    g->dim = dim;
+    g->inv = (float)dim * 0.5f;
+
+    const size_t cells = (size_t)dim*dim*dim;
+    g->head = malloc(cells * sizeof(int));
+    g->next = malloc(n * sizeof(int));
+    g->prev = malloc(n * sizeof(int));
+    g->cell = malloc(n * sizeof(int));
+    g->cand = malloc(n * sizeof(unsigned int));
+    if(g->head == NULL || g->next == NULL || g->prev == NULL || g->cell == NULL || g->cand == NULL)
+    {
+        simGridFree(g);
+        return -1;
+    }
+    memset(g->head, 0xFF, cells * sizeof(int));
+    memset(g->cell, 0xFF, n * sizeof(int));
+    return 0;
+}
+
+// cells must be at least the collision distance wide
+int simGridInit(sim* s)
+{
+    return simGridAlloc(&s->grid, s->n, s->scale*1.8f);
+}
+
+// positions outside the cube are clamped into the border cells which keeps neighbours adjacent
+static inline int simGridCoord(const simgrid* g, const float p)
+{
+    const float f = (p + 1.f) * g->inv;
+    if(!(f > 0.f)){return 0;} // also catches NaN
+    if(f >= (float)(g->dim-1)){return g->dim-1;}
+    return (int)f;
+}
+
+static inline int simGridCell(const simgrid* g, const float x, const float y, const float z)
+{
+    return (simGridCoord(g, z)*g->dim + simGridCoord(g, y))*g->dim + simGridCoord(g, x);
+}
+
+static inline void simGridLink(simgrid* g, const int i, const int c)
+{
+    g->cell[i] = c;
+    g->prev[i] = -1;
+    g->next[i] = g->head[c];
+    if(g->head[c] != -1){g->prev[g->head[c]] = i;}
+    g->head[c] = i;
+}
+
+static inline void simGridUnlink(simgrid* g, const int i)
+{
+    const int c = g->cell[i];
+    if(g->prev[i] != -1){g->next[g->prev[i]] = g->next[i];}
+    else{g->head[c] = g->next[i];}
+    if(g->next[i] != -1){g->prev[g->next[i]] = g->prev[i];}
+    g->cell[i] = -1;
+}
+
+static void simGridFile(simgrid* g, const sim* s)
+{
+    // only the cells that were in use need clearing
+    for(unsigned int i = 0; i < s->n; i++)
+        if(g->cell[i] != -1)
+            g->head[g->cell[i]] = -1;
+
+    for(unsigned int i = 0; i < s->n; i++)
+        simGridLink(g, i, simGridCell(g, s->x[i], s->y[i], s->z[i]));
+}
+
+void simGridBuild(sim* s)
+{
+    simGridFile(&s->grid, s);
+}
+
+// gather the spheres in the 27 cells around pos with an index above after, sorted by index
+static unsigned int simGridCollect(const simgrid* g, const unsigned int i, const vec pos, const int after)
+{
+    const int cx = simGridCoord(g, pos.x);
+    const int cy = simGridCoord(g, pos.y);
+    const int cz = simGridCoord(g, pos.z);
+    const int dmax = g->dim-1;
+
+    unsigned int nc = 0;
+    for(int z = cz > 0 ? cz-1 : 0; z <= (cz < dmax ? cz+1 : dmax); z++)
+    {
+        for(int y = cy > 0 ? cy-1 : 0; y <= (cy < dmax ? cy+1 : dmax); y++)
+        {
+            for(int x = cx > 0 ? cx-1 : 0; x <= (cx < dmax ? cx+1 : dmax); x++)
+            {
+                for(int j = g->head[(z*g->dim + y)*g->dim + x]; j != -1; j = g->next[j])
+                {
+                    if(j <= after || j == (int)i){continue;}
+
+                    // insertion sort, cells rarely hold more than a few spheres
+                    unsigned int k = nc++;
+                    while(k > 0 && g->cand[k-1] > (unsigned int)j)
+                    {
+                        g->cand[k] = g->cand[k-1];
+                        k--;
+                    }
+                    g->cand[k] = j;
+                }
+            }
+        }
+    }
+    return nc;
+}
+
+static unsigned int simGridGather(const sim* s, const unsigned int i, const vec pos, const int after)
+{
+    return simGridCollect(&s->grid, i, pos, after);
+}
+
+// a uniform grid of at least the collision distance, candidates are tested in index order and gathered again when a hit moves sphere i to another cell
+void sim_step_grid(sim* s, unsigned char* hit)
+{
+    simgrid* g = &s->grid;
+    if(g->head == NULL && simGridInit(s) < 0)
+    {
+        sim_step(s, hit);
+        return;
+    }
+    simGridBuild(s);
+
+    const float cd = s->scale*1.8f;
+    uint64_t tests = 0;
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        vec pos, dir;
+        simGet(s, i, &pos, &dir);
+        simMoveWall(s, &pos, &dir);
+
+        unsigned char h = 0;
+        int c = simGridCell(g, pos.x, pos.y, pos.z);
+        unsigned int nc = simGridGather(s, i, pos, -1);
+        unsigned int k = 0;
+        while(k < nc)
+        {
+            const unsigned int j = g->cand[k++];
+            const vec pj = {s->x[j], s->y[j], s->z[j], 0.f};
+            tests++;
+            const float d = vDist(pos, pj);
+            if(d < cd)
+            {
+                simCollide(s, i, j, d, cd, &pos, &dir);
+                h = 1;
+
+                // if pos moved cell gather the remaining partners around the new position
+                if(simGridCell(g, pos.x, pos.y, pos.z) != c)
+                {
+                    c = simGridCell(g, pos.x, pos.y, pos.z);
+                    nc = simGridGather(s, i, pos, j);
+                    k = 0;
+                }
+            }
+        }
+
+        simSet(s, i, pos, dir);
+        if(hit != NULL){hit[i] = h;}
+
+        // keep the grid current for the spheres that follow
+        c = simGridCell(g, pos.x, pos.y, pos.z);
+        if(c != g->cell[i])
+        {
+            simGridUnlink(g, i);
+            simGridLink(g, i, c);
+        }
+    }
+    g->tests = tests;
+}
+
+//*************************************
+// verlet neighbour lists
+//*************************************
+
+static void simVerletFree(simverlet* v)
+{
+    free(v->start); free(v->list);
+    free(v->bx); free(v->by); free(v->bz);
+    free(v->loose); free(v->isloose); free(v->cand);
+    simGridFree(&v->grid);
+    memset(v, 0, sizeof(simverlet));
+}
+
+static int simVerletInit(sim* s)
+{
+    simverlet* v = &s->verlet;
+    v->skin = 2.f*SIM_VERLET_STEPS*s->speed;
+    v->cap = (size_t)s->n*16;
+    v->start = malloc((s->n+1) * sizeof(unsigned int));
+    v->list = malloc(v->cap * sizeof(unsigned int));
+    v->bx = malloc(s->n * sizeof(float));
+    v->by = malloc(s->n * sizeof(float));
+    v->bz = malloc(s->n * sizeof(float));
+    v->maxloose = s->n/64 > SIM_VERLET_LOOSE ? s->n/64 : SIM_VERLET_LOOSE;
+    v->loose = malloc(v->maxloose * sizeof(unsigned int));
+    v->isloose = malloc(s->n);
+    v->cand = malloc((s->n + v->maxloose) * sizeof(unsigned int));
+    if(v->start == NULL || v->list == NULL || v->bx == NULL || v->by == NULL || v->bz == NULL ||
+        v->loose == NULL || v->isloose == NULL || v->cand == NULL ||
+        (s->n >= SIM_GRID_MIN && simGridAlloc(&v->grid, s->n, s->scale*1.8f + v->skin) < 0))
+    {
+        simVerletFree(v);
+        return -1;
+    }
+    v->stale = 1;
+    return 0;
+}
+
+static inline int simVerletAdd(simverlet* v, const size_t at, const unsigned int j)
+{
+    if(at == v->cap)
+    {
+        unsigned int* l = realloc(v->list, v->cap*2 * sizeof(unsigned int));
+        if(l == NULL){return -1;}
+        v->list = l;
+        v->cap *= 2;
+    }
+    v->list[at] = j;
+    return 0;
+}
+
+// list every sphere within the collision distance plus skin of each sphere
+static int simVerletBuild(sim* s)
+{
+    simverlet* v = &s->verlet;
+    const float r = s->scale*1.8f + v->skin;
+    if(v->grid.head != NULL){simGridFile(&v->grid, s);}
+
+    size_t at = 0;
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        v->start[i] = at;
+        const vec pi = {s->x[i], s->y[i], s->z[i], 0.f};
+        if(v->grid.head != NULL)
+        {
+            const unsigned int nc = simGridCollect(&v->grid, i, pi, -1);
+            for(unsigned int k = 0; k < nc; k++)
+            {
+                const unsigned int j = v->grid.cand[k];
+                const vec pj = {s->x[j], s->y[j], s->z[j], 0.f};
+                if(vDist(pi, pj) < r && simVerletAdd(v, at++, j) < 0){return -1;}
+            }
+        }
+        else
+        {
+            for(unsigned int j = 0; j < s->n; j++)
+            {
+                if(j == i){continue;}
+                const vec pj = {s->x[j], s->y[j], s->z[j], 0.f};
+                if(vDist(pi, pj) < r && simVerletAdd(v, at++, j) < 0){return -1;}
+            }
+        }
+        v->bx[i] = s->x[i], v->by[i] = s->y[i], v->bz[i] = s->z[i];
+    }
+    v->start[s->n] = at;
+    v->nloose = 0;
+    memset(v->isloose, 0, s->n);
+    v->stale = 0;
+    v->age = 0;
+    v->builds++;
+    return 0;
+}
+
+// 1 if pos is more than half the skin from where sphere i was at the last build, a little under half covers rounding
+static inline int simVerletMoved(const simverlet* v, const unsigned int i, const vec pos)
+{
+    const float x = pos.x - v->bx[i], y = pos.y - v->by[i], z = pos.z - v->bz[i];
+    const float h = v->skin*0.49f;
+    return x*x + y*y + z*z > h*h;
+}
+
+// sphere i has moved too far for the lists, -1 if there are already too many loose spheres
+static int simVerletLoosen(simverlet* v, const unsigned int i)
+{
+    if(v->nloose == v->maxloose){return -1;}
+    unsigned int k = v->nloose++;
+    while(k > 0 && v->loose[k-1] > i)
+    {
+        v->loose[k] = v->loose[k-1];
+        k--;
+    }
+    v->loose[k] = i;
+    v->isloose[i] = 1;
+    return 0;
+}
+
+// every sphere that sphere i at pos could be touching with an index above after, sorted by index, all = every sphere
+static unsigned int simVerletGather(sim* s, const unsigned int i, const vec pos, const int after, const int all)
+{
+    simverlet* v = &s->verlet;
+    const unsigned int* a;
+    unsigned int na;
+    if(all == 0 && v->isloose[i] == 0)
+    {
+        a = &v->list[v->start[i]];
+        na = v->start[i+1] - v->start[i];
+    }
+    else if(all == 0 && v->grid.head != NULL)
+    {
+        // spheres still near their build positions are filed in the cells around pos
+        na = simGridCollect(&v->grid, i, pos, after);
+        a = v->grid.cand;
+    }
+    else
+    {
+        // below SIM_GRID_MIN a loose sphere tests every sphere
+        unsigned int nc = 0;
+        for(unsigned int j = after+1; j < s->n; j++)
+            if(j != i)
+                v->cand[nc++] = j;
+        return nc;
+    }
+
+    // merge the spheres that are not loose with the loose ones
+    unsigned int nc = 0, p = 0, q = 0;
+    while(p < na && (int)a[p] <= after){p++;}
+    while(q < v->nloose && (int)v->loose[q] <= after){q++;}
+    while(p < na || q < v->nloose)
+    {
+        if(p < na && v->isloose[a[p]] == 1){p++; continue;}
+        if(q < v->nloose && v->loose[q] == i){q++; continue;}
+        if(q == v->nloose || (p < na && a[p] < v->loose[q])){v->cand[nc++] = a[p++];}
+        else{v->cand[nc++] = v->loose[q++];}
+    }
+    return nc;
+}
+
+// neighbour lists with a skin of SIM_VERLET_STEPS steps of movement, a sphere that moves further is set loose and tested against the build grid,
+// it loses to the grid when collisions are common so simSelectStep() does not pick it
+void sim_step_verlet(sim* s, unsigned char* hit)
+{
+    simverlet* v = &s->verlet;
+    if((v->start == NULL && simVerletInit(s) < 0) || (v->stale == 1 && simVerletBuild(s) < 0))
+    {
+        v->stale = 1;
+        sim_step(s, hit);
+        return;
+    }
+
+    // once too many spheres are loose the rest of the step tests every pair and the lists are rebuilt after
+    const float cd = s->scale*1.8f;
+    int all = 0;
+    uint64_t tests = 0;
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        vec pos, dir;
+        simGet(s, i, &pos, &dir);
+        simMoveWall(s, &pos, &dir);
+        if(all == 0 && v->isloose[i] == 0 && simVerletMoved(v, i, pos) == 1 && simVerletLoosen(v, i) < 0){all = 1;}
+
+        unsigned char h = 0;
+        unsigned int nc = simVerletGather(s, i, pos, -1, all);
+        unsigned int k = 0;
+        while(k < nc)
+        {
+            const unsigned int j = v->cand[k++];
+            const vec pj = {s->x[j], s->y[j], s->z[j], 0.f};
+            tests++;
+            const float d = vDist(pos, pj);
+            if(d < cd)
+            {
+                simCollide(s, i, j, d, cd, &pos, &dir);
+                h = 1;
+
+                // pushed too far for its list, or loose and gathered around where it was, find the remaining partners around the new position
+                if(all == 0 && (v->isloose[i] == 1 || simVerletMoved(v, i, pos) == 1))
+                {
+                    if(v->isloose[i] == 0 && simVerletLoosen(v, i) < 0){all = 1;}
+                    nc = simVerletGather(s, i, pos, j, all);
+                    k = 0;
+                }
+            }
+        }
+
+        simSet(s, i, pos, dir);
+        if(hit != NULL){hit[i] = h;}
+    }
+    // every sphere moves the same distance each step so the lists are rebuilt before free flight alone loosens them all
+    if(all == 1 || v->nloose > v->maxloose/2 || ++v->age == SIM_VERLET_STEPS-1){v->stale = 1;}
+    v->tests = tests;
+}
+
+//*************************************
+// morton order
+//*************************************
+
+// spread the low SIM_MORTON_BITS bits of v to every third bit
+static inline uint32_t simMortonSpread(uint32_t v)
+{
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v <<  8)) & 0x0300F00F;
+    v = (v | (v <<  4)) & 0x030C30C3;
+    v = (v | (v <<  2)) & 0x09249249;
+    return v;
+}
+
+static inline uint32_t simMortonAxis(const float p)
+{
+    const float f = (p + 1.f) * (float)(1 << (SIM_MORTON_BITS-1));
+    if(!(f > 0.f)){return 0;} // also catches NaN
+    if(f >= (float)((1 << SIM_MORTON_BITS)-1)){return (1 << SIM_MORTON_BITS)-1;}
+    return (uint32_t)f;
+}
+
+static int simMortonCompare(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// spheres close in space end up close in memory, only for the pair kernels as the ordered ones resolve in slot order
+int simReorder(sim* s)
+{
+    // sort keys of the code above the slot it is in
+    uint64_t* key = malloc(s->n * sizeof(uint64_t));
+    unsigned int* id = malloc(s->n * sizeof(unsigned int));
+    float* tmp = aligned_alloc(32, s->np * sizeof(float));
+    if(key == NULL || id == NULL || tmp == NULL || (s->id == NULL && (s->slot = malloc(s->n * sizeof(unsigned int))) == NULL))
+    {
+        free(key); free(id); free(tmp);
+        return -1;
+    }
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        const uint32_t code = simMortonSpread(simMortonAxis(s->x[i])) | simMortonSpread(simMortonAxis(s->y[i])) << 1 | simMortonSpread(simMortonAxis(s->z[i])) << 2;
+        key[i] = (uint64_t)code << 32 | i;
+    }
+    qsort(key, s->n, sizeof(uint64_t), simMortonCompare);
+
+    // gather each array into the new order, the padding lanes stay where they are
+    float** a[6] = {&s->x, &s->y, &s->z, &s->dx, &s->dy, &s->dz};
+    for(int k = 0; k < 6; k++)
+    {
+        float* f = *a[k];
+        for(unsigned int i = 0; i < s->n; i++)
+            tmp[i] = f[(uint32_t)key[i]];
+        for(unsigned int i = s->n; i < s->np; i++)
+            tmp[i] = f[i];
+        *a[k] = tmp;
+        tmp = f;
+    }
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        const unsigned int from = (uint32_t)key[i];
+        id[i] = s->id == NULL ? from : s->id[from];
+        s->slot[id[i]] = i;
+    }
+    free(s->id);
+    s->id = id;
+    free(key);
+    free(tmp);
+    s->verlet.stale = 1;
+    return 0;
+}
+
+//*************************************
+// once per pair resolution
+//*************************************
+
+// move every sphere and clear the contact sums, the pairs are then tested against this snapshot
+static void simPairsBegin(sim* s)
+{
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        vec pos, dir;
+        simGet(s, i, &pos, &dir);
+        simMoveWall(s, &pos, &dir);
+        simSet(s, i, pos, dir);
+    }
+    memset(s->cx, 0, s->n * sizeof(int64_t));
+    memset(s->cy, 0, s->n * sizeof(int64_t));
+    memset(s->cz, 0, s->n * sizeof(int64_t));
+    memset(s->pen, 0, s->n * sizeof(float));
+}
+
+// spheres i and j are at distance d, both reflect off the other's direction from the snapshot
+static inline void simPairCollide(sim* s, const unsigned int i, const unsigned int j, const float d, const float cd)
+{
+    const vec di = {s->dx[i], s->dy[i], s->dz[i], 0.f};
+    const vec dj = {s->dx[j], s->dy[j], s->dz[j], 0.f};
+    vec r;
+
+    vReflect(&r, dj, di);
+    s->cx[i] += (int64_t)(r.x*SIM_PAIR_FIX), s->cy[i] += (int64_t)(r.y*SIM_PAIR_FIX), s->cz[i] += (int64_t)(r.z*SIM_PAIR_FIX);
+    vReflect(&r, di, dj);
+    s->cx[j] += (int64_t)(r.x*SIM_PAIR_FIX), s->cy[j] += (int64_t)(r.y*SIM_PAIR_FIX), s->cz[j] += (int64_t)(r.z*SIM_PAIR_FIX);
+
+    // the partner of each is the one it overlaps most
+    const float p = cd-d;
+    if(p > s->pen[i])
+    {
+        s->pen[i] = p;
+        if(s->partner != NULL){s->partner[i] = simId(s, j);}
+    }
+    if(p > s->pen[j])
+    {
+        s->pen[j] = p;
+        if(s->partner != NULL){s->partner[j] = simId(s, i);}
+    }
+}
+
+// turn the contact sums into new directions and push every sphere that was hit out of the overlap
+static void simPairsApply(sim* s, unsigned char* hit)
+{
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        const unsigned char h = s->pen[i] > 0.f;
+        if(hit != NULL){hit[i] = h;}
+        if(h == 0){continue;}
+
+        vec pos, dir;
+        simGet(s, i, &pos, &dir);
+        const vec sum = {(float)s->cx[i] * (1.f/SIM_PAIR_FIX), (float)s->cy[i] * (1.f/SIM_PAIR_FIX), (float)s->cz[i] * (1.f/SIM_PAIR_FIX), 0.f};
+        if(vMag(sum) > 0.f) // reflections that cancel out keep the old direction
+        {
+            dir = sum;
+            vNorm(&dir);
+        }
+
+        vec inc;
+        vMulS(&inc, dir, s->pen[i]+s->speed);
+        vAdd(&pos, pos, inc);
+        simSet(s, i, pos, dir);
+    }
+}
+
+// every sphere moves, then each pair is tested once against that snapshot and contacts add up in fixed point so the order does not matter,
+// one contact gets the reflection and push of the ordered loop, more take the normalised sum of reflections and the deepest overlap
+void sim_step_pairs(sim* s, unsigned char* hit)
+{
+    simPairsBegin(s);
+    const float cd = s->scale*1.8f;
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        const vec pi = {s->x[i], s->y[i], s->z[i], 0.f};
+        for(unsigned int j = i+1; j < s->n; j++)
+        {
+            const vec pj = {s->x[j], s->y[j], s->z[j], 0.f};
+            const float d = vDist(pi, pj);
+            if(d < cd){simPairCollide(s, i, j, d, cd);}
+        }
+    }
+    simPairsApply(s, hit);
+}
+
+void sim_step_pairs_grid(sim* s, unsigned char* hit)
+{
+    simgrid* g = &s->grid;
+    if(g->head == NULL && simGridInit(s) < 0)
+    {
+        sim_step_pairs(s, hit);
+        return;
+    }
+    simPairsBegin(s);
+    simGridBuild(s);
+
+    // positions do not change until the end so one gather per sphere finds every partner above it
+    const float cd = s->scale*1.8f;
+    uint64_t tests = 0;
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        const vec pi = {s->x[i], s->y[i], s->z[i], 0.f};
+        const unsigned int nc = simGridGather(s, i, pi, i);
+        for(unsigned int k = 0; k < nc; k++)
+        {
+            const unsigned int j = g->cand[k];
+            const vec pj = {s->x[j], s->y[j], s->z[j], 0.f};
+            tests++;
+            const float d = vDist(pi, pj);
+            if(d < cd){simPairCollide(s, i, j, d, cd);}
+        }
+    }
+    g->tests = tests;
+    simPairsApply(s, hit);
+}
+
+//*************************************
+// free flight skip ahead
+//*************************************
+
+static void simFlightFree(simflight* f)
+{
+    free(f->t); free(f->wall); free(f->pair); free(f->near); free(f->act);
+    free(f->out); free(f->hits); free(f->pos); free(f->dir);
+    memset(f, 0, sizeof(simflight));
+}
+
+static int simFlightInit(sim* s)
+{
+    simflight* f = &s->flight;
+    const size_t n = s->n;
+    f->t = malloc(n * sizeof(unsigned int));
+    f->wall = malloc(n * sizeof(unsigned int));
+    f->pair = malloc(n * n * sizeof(unsigned int));
+    f->near = malloc(n * sizeof(unsigned int));
+    f->act = malloc(n * sizeof(unsigned int));
+    f->out = malloc(n);
+    f->hits = malloc(n);
+    f->pos = malloc(n * sizeof(vec));
+    f->dir = malloc(n * sizeof(vec));
+    if(f->t == NULL || f->wall == NULL || f->pair == NULL || f->near == NULL || f->act == NULL ||
+        f->out == NULL || f->hits == NULL || f->pos == NULL || f->dir == NULL){simFlightFree(f); return -1;}
+    return 0;
+}
+
+// whole steps sphere i can move in a straight line before the step that takes it through the wall, at most n, -1 if it is outside
+static inline int simFreeSteps(const sim* s, const unsigned int i, const unsigned int n)
+{
+    const double px = s->x[i], py = s->y[i], pz = s->z[i];
+    const double vx = s->dx[i]*s->speed, vy = s->dy[i]*s->speed, vz = s->dz[i]*s->speed;
+    const double a = vx*vx + vy*vy + vz*vz, b = px*vx + py*vy + pz*vz, c = px*px + py*py + pz*pz - 1.0;
+    if(c > 0.0){return -1;}
+    if(a == 0.0){return n;}
+
+    // |p + t*v| = 1 has one root t >= 0 from inside, the last whole step before it is the last step in free flight
+    const double t = (sqrt(b*b - a*c) - b) / a;
+    if(t >= n){return n;}
+    unsigned int j = (unsigned int)t;
+
+    // the jump is rounded as floats so check the step it lands on is still inside the way simMoveWall() does
+    while(j > 0)
+    {
+        const vec p = {s->x[i] + (float)j*(s->dx[i]*s->speed), s->y[i] + (float)j*(s->dy[i]*s->speed), s->z[i] + (float)j*(s->dz[i]*s->speed), 0.f};
+        if(vMod(p) <= 1.f){break;}
+        j--;
+    }
+    return j;
+}
+
+// sphere i is at step now of k, find its next bounce
+static inline void simFlightWall(sim* s, const unsigned int i, const unsigned int now, const unsigned int k)
+{
+    const int f = simFreeSteps(s, i, k - now);
+    s->flight.t[i] = now;
+    s->flight.out[i] = f < 0;
+    s->flight.wall[i] = now + (f < 0 ? 0 : f);
+}
+
+// move sphere i on to step to in free flight, jumping straight to each bounce
+static void simFly(sim* s, const unsigned int i, const unsigned int to, const unsigned int k)
+{
+    simflight* f = &s->flight;
+    unsigned int now = f->t[i];
+    while(now < to)
+    {
+        const unsigned int end = f->wall[i] < to ? f->wall[i] : to;
+        const float j = (float)(end - now);
+        s->x[i] += j*(s->dx[i]*s->speed);
+        s->y[i] += j*(s->dy[i]*s->speed);
+        s->z[i] += j*(s->dz[i]*s->speed);
+        now = end;
+        if(now == to){break;}
+
+        // the step through the wall is an ordinary step
+        vec pos, dir;
+        simGet(s, i, &pos, &dir);
+        simMoveWall(s, &pos, &dir);
+        simSet(s, i, pos, dir);
+        simFlightWall(s, i, ++now, k);
+    }
+    f->t[i] = to;
+}
+
+// the last step up to k that spheres i and j can not meet by, both at step now
+static inline unsigned int simPairBound(const sim* s, const unsigned int i, const unsigned int j, const unsigned int now, const unsigned int k)
+{
+    // a sphere outside the unit sphere jumps back in and could land anywhere
+    const simflight* f = &s->flight;
+    if(f->out[i] == 1 || f->out[j] == 1){return now;}
+
+    // the ordered loop measures a moved sphere against one that has not moved yet so the reach is a step wider, the margin covers rounding
+    const double sp = s->speed, r = s->scale*1.8f + sp + 1e-4;
+    const double px = s->x[i] - s->x[j], py = s->y[i] - s->y[j], pz = s->z[i] - s->z[j];
+    const double c = px*px + py*py + pz*pz;
+    const double far = r + 6.0*sp*(k - now); // a step closes a pair by at most two steps of movement and a bounce adds up to two more for each sphere
+    if(c >= far*far){return k;}
+    if(c <= r*r){return now;}
+
+    // until either bounces they fly in straight lines and the step the gap first closes to r is a quadratic, less one step as a kernel can round a bounce a step early
+    const unsigned int w = f->wall[i] < f->wall[j] ? f->wall[i] : f->wall[j];
+    const double m = w > now ? w - now - 1 : 0;
+    const double vx = (s->dx[i] - s->dx[j])*sp, vy = (s->dy[i] - s->dy[j])*sp, vz = (s->dz[i] - s->dz[j])*sp;
+    const double a = vx*vx + vy*vy + vz*vz, b = px*vx + py*vy + pz*vz, q = b*b - a*(c - r*r);
+    double t = m + 1.0;
+    if(a > 0.0 && b < 0.0 && q > 0.0){t = (-b - sqrt(q)) / a;}
+    if(t > m)
+    {
+        // then they close at no more than six steps of movement a step from where they are after m
+        const double gx = px + vx*m, gy = py + vy*m, gz = pz + vz*m;
+        t = m + (sqrt(gx*gx + gy*gy + gz*gz) - r) / (6.0*sp);
+    }
+    return t >= k - now ? k : now + (unsigned int)t;
+}
+
+// measure spheres i and j again at step now, near[] only ever falls here so it is a lower bound until the row is measured
+static void simFlightPair(sim* s, const unsigned int i, const unsigned int j, const unsigned int now, const unsigned int k)
+{
+    simflight* f = &s->flight;
+    simFly(s, i, now, k);
+    simFly(s, j, now, k);
+    const unsigned int b = simPairBound(s, i, j, now, k);
+    f->pair[(size_t)i*s->n + j] = f->pair[(size_t)j*s->n + i] = b;
+    if(b < f->near[i]){f->near[i] = b;}
+    if(b < f->near[j]){f->near[j] = b;}
+}
+
+// measure the pairs of sphere i whose bound has run out, or all of them
+static void simFlightRow(sim* s, const unsigned int i, const unsigned int now, const unsigned int k, const int all)
+{
+    simflight* f = &s->flight;
+    const unsigned int* p = &f->pair[(size_t)i*s->n];
+    for(unsigned int j = 0; j < s->n; j++)
+        if(j != i && (all == 1 || p[j] <= now))
+            simFlightPair(s, i, j, now, k);
+
+    // the diagonal holds k so the least of the row is a loop that vectorises
+    unsigned int near = k;
+    for(unsigned int j = 0; j < s->n; j++){near = p[j] < near ? p[j] : near;}
+    f->near[i] = near;
+}
+
+// the spheres in reach take step now in free flight and 0 is returned, unless two of them could meet and nothing is changed
+static int simFlightStep(sim* s, const unsigned int na, const unsigned int now, const unsigned int k)
+{
+    simflight* f = &s->flight;
+    const float cd = s->scale*1.8f;
+    for(unsigned int a = 0; a < na; a++)
+    {
+        simGet(s, f->act[a], &f->pos[a], &f->dir[a]);
+        simMoveWall(s, &f->pos[a], &f->dir[a]);
+    }
+
+    // the ordered loop measures a sphere moved against the spheres before it moved and after it not yet, the pair kernels all moved
+    for(unsigned int a = 0; a < na; a++)
+    {
+        for(unsigned int b = a+1; b < na; b++)
+        {
+            const unsigned int j = f->act[b];
+            const vec pj = {s->x[j], s->y[j], s->z[j], 0.f};
+            if(vDist(f->pos[a], f->pos[b]) < cd || vDist(f->pos[a], pj) < cd){return 1;}
+        }
+    }
+
+    for(unsigned int a = 0; a < na; a++)
+    {
+        const unsigned int i = f->act[a];
+        simSet(s, i, f->pos[a], f->dir[a]);
+        simFlightWall(s, i, now+1, k);
+    }
+    return 0;
+}
+
+unsigned int sim_advance(sim* s, const unsigned int k, sim_step_fn step, unsigned char* hit)
+{
+    simflight* f = &s->flight;
+    if(f->pair == NULL && simFlightInit(s) < 0)
+    {
+        // out of memory, take every step and only the collisions of the last are known
+        for(unsigned int t = 0; t < k; t++){step(s, hit);}
+        return 0;
+    }
+    if(hit != NULL){memset(hit, 0, s->n);}
+
+    // every pair gets the last step it can not meet by
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        simFlightWall(s, i, 0, k);
+        f->near[i] = k;
+        f->pair[(size_t)i*s->n + i] = k;
+    }
+    for(unsigned int i = 0; i < s->n; i++)
+        for(unsigned int j = i+1; j < s->n; j++)
+            simFlightPair(s, i, j, 0, k);
+
+    // until then neither sphere is moved, the pairs that run out are measured again and the spheres of any still in reach take the step
+    unsigned int now = 0, skipped = 0;
+    while(now < k)
+    {
+        unsigned int na = 0, to = k;
+        for(unsigned int i = 0; i < s->n; i++)
+        {
+            if(f->near[i] <= now){simFlightRow(s, i, now, k, 0);}
+            if(f->near[i] <= now){f->act[na++] = i;}
+            else if(f->near[i] < to){to = f->near[i];}
+        }
+        if(na == 0)
+        {
+            skipped += to - now;
+            now = to;
+            continue;
+        }
+        if(simFlightStep(s, na, now, k) == 0)
+        {
+            now++;
+            continue;
+        }
+
+        // two could meet, every sphere takes the step together and the bounds of any that were pushed are void
+        for(unsigned int i = 0; i < s->n; i++){simFly(s, i, now, k);}
+        step(s, f->hits);
+        now++;
+        for(unsigned int i = 0; i < s->n; i++){simFlightWall(s, i, now, k);}
+        for(unsigned int i = 0; i < s->n; i++)
+        {
+            if(f->hits[i] == 0 && f->out[i] == 0){continue;}
+            if(hit != NULL){hit[i] |= f->hits[i];}
+            simFlightRow(s, i, now, k, 1);
+        }
+    }
+    for(unsigned int i = 0; i < s->n; i++){simFly(s, i, k, k);}
+    s->verlet.stale = 1;
+    return skipped;
+}
+
+#ifndef NOSSE
+
+__attribute__((target("avx2"), always_inline))
+static inline unsigned int sim_pair_mask8(const sim* s, const unsigned int j, const __m256 px, const __m256 py, const __m256 pz, const __m256 cd)
+{
+    const __m256 xm = _mm256_sub_ps(px, _mm256_load_ps(&s->x[j]));
+    const __m256 ym = _mm256_sub_ps(py, _mm256_load_ps(&s->y[j]));
+    const __m256 zm = _mm256_sub_ps(pz, _mm256_load_ps(&s->z[j]));
+    const __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(xm, xm), _mm256_mul_ps(ym, ym)), _mm256_mul_ps(zm, zm));
+    return _mm256_movemask_ps(_mm256_cmp_ps(_mm256_sqrt_ps(d2), cd, _CMP_LT_OQ));
+}
+
+// sim_step_avx2() for n spheres padded to np, inlined into the fixed count kernels below with both constant
+__attribute__((target("avx2"), always_inline))
+static inline void simStepAvx2(sim* s, unsigned char* hit, const unsigned int n, const unsigned int np)
+{
+    const float cd = s->scale*1.8f;
+    const __m256 cdv = _mm256_set1_ps(cd);
+    uint64_t tests = 0;
+    for(unsigned int i = 0; i < n; i++)
+    {
+        vec pos, dir;
+        simGet(s, i, &pos, &dir);
+        simMoveWall(s, &pos, &dir);
+
+        unsigned char h = 0;
+        for(unsigned int j = 0; j < np; j += SIM_LANES)
+        {
+            tests += SIM_LANES;
+            // lanes at or below the last resolved partner and the self lane are skipped
+            unsigned int skip = (i - j < SIM_LANES) ? 1u << (i - j) : 0;
+            unsigned int m = sim_pair_mask8(s, j, _mm256_set1_ps(pos.x), _mm256_set1_ps(pos.y), _mm256_set1_ps(pos.z), cdv) & ~skip;
+            while(m != 0)
+            {
+                const unsigned int k = __builtin_ctz(m);
+                const vec pj = {s->x[j+k], s->y[j+k], s->z[j+k], 0.f};
+                simCollide(s, i, j+k, vDist(pos, pj), cd, &pos, &dir);
+                h = 1;
+
+                // pos moved so the remaining lanes must be tested again
+                skip |= (2u << k) - 1;
+                m = sim_pair_mask8(s, j, _mm256_set1_ps(pos.x), _mm256_set1_ps(pos.y), _mm256_set1_ps(pos.z), cdv) & ~skip;
+                tests += SIM_LANES;
+            }
+        }
+
+        simSet(s, i, pos, dir);
+        if(hit != NULL){hit[i] = h;}
+    }
+    s->tests = tests;
+}
+
+// 8 candidate partners per instruction, hits are resolved in index order with the reference code, no FMA as it would round the distance differently
+__attribute__((target("avx2")))
+void sim_step_avx2(sim* s, unsigned char* hit)
+{
+    simStepAvx2(s, hit, s->n, s->np);
+}
+
+// sim_step_mask() for n spheres padded to np
+__attribute__((target("avx2"), always_inline))
+static inline void simStepMask(sim* s, unsigned char* hit, const unsigned int n, const unsigned int np)
+{
+    const float cd = s->scale*1.8f;
+    const uint32_t all = n == 32 ? 0xFFFFFFFFu : (1u << n) - 1;
+
+    // a sphere inside the unit sphere moves at most one step and a wall bounce adds up to two more, the rest covers rounding
+    const float r = cd + 6.f*s->speed + 1e-4f;
+    const __m256 r2 = _mm256_set1_ps(r*r), one = _mm256_set1_ps(1.f);
+    uint32_t near[SIM_MASK_MAX], wild = 0, any;
+    for(unsigned int j = 0; j < np; j += SIM_LANES)
+    {
+        const __m256 x = _mm256_load_ps(&s->x[j]), y = _mm256_load_ps(&s->y[j]), z = _mm256_load_ps(&s->z[j]);
+        const __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z));
+        wild |= (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(d2, one, _CMP_GT_OQ)) << j;
+    }
+    wild &= all;
+    any = wild;
+    for(unsigned int i = 0; i < n; i++)
+    {
+        const __m256 px = _mm256_set1_ps(s->x[i]), py = _mm256_set1_ps(s->y[i]), pz = _mm256_set1_ps(s->z[i]);
+        uint32_t m = 0;
+        for(unsigned int j = 0; j < np; j += SIM_LANES)
+        {
+            const __m256 xm = _mm256_sub_ps(px, _mm256_load_ps(&s->x[j]));
+            const __m256 ym = _mm256_sub_ps(py, _mm256_load_ps(&s->y[j]));
+            const __m256 zm = _mm256_sub_ps(pz, _mm256_load_ps(&s->z[j]));
+            const __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(xm, xm), _mm256_mul_ps(ym, ym)), _mm256_mul_ps(zm, zm));
+            m |= (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(d2, r2, _CMP_LT_OQ)) << j;
+        }
+        near[i] = m & ~(1u << i) & all;
+        any |= near[i];
+    }
+    uint64_t tests = (uint64_t)n * np;
+
+    // nothing can collide so the order does not matter, move everything 8 at a time and bounce the few that cross the wall
+    if(any == 0)
+    {
+        const __m256 sp = _mm256_set1_ps(s->speed);
+        for(unsigned int j = 0; j < np; j += SIM_LANES)
+        {
+            const __m256 x0 = _mm256_load_ps(&s->x[j]), y0 = _mm256_load_ps(&s->y[j]), z0 = _mm256_load_ps(&s->z[j]);
+            const __m256 x = _mm256_add_ps(x0, _mm256_mul_ps(_mm256_load_ps(&s->dx[j]), sp));
+            const __m256 y = _mm256_add_ps(y0, _mm256_mul_ps(_mm256_load_ps(&s->dy[j]), sp));
+            const __m256 z = _mm256_add_ps(z0, _mm256_mul_ps(_mm256_load_ps(&s->dz[j]), sp));
+            const __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z));
+
+            // a modulus over 1 needs its square over 1, those lanes keep their old position for simMoveWall()
+            const __m256 out = _mm256_cmp_ps(d2, one, _CMP_GT_OQ);
+            _mm256_store_ps(&s->x[j], _mm256_blendv_ps(x, x0, out));
+            _mm256_store_ps(&s->y[j], _mm256_blendv_ps(y, y0, out));
+            _mm256_store_ps(&s->z[j], _mm256_blendv_ps(z, z0, out));
+            uint32_t m = (uint32_t)_mm256_movemask_ps(out) << j & all;
+            while(m != 0)
+            {
+                const unsigned int i = __builtin_ctz(m);
+                m &= m - 1;
+                vec pos, dir;
+                simGet(s, i, &pos, &dir);
+                simMoveWall(s, &pos, &dir);
+                simSet(s, i, pos, dir);
+            }
+        }
+        if(hit != NULL){memset(hit, 0, n);}
+        s->tests = tests;
+        return;
+    }
+
+    uint32_t pushed = 0;
+    for(unsigned int i = 0; i < n; i++)
+    {
+        vec pos, dir;
+        simGet(s, i, &pos, &dir);
+        simMoveWall(s, &pos, &dir);
+
+        unsigned char h = 0;
+        uint32_t cand = ((wild >> i) & 1 ? all : near[i] | wild | pushed) & ~(1u << i);
+        while(cand != 0)
+        {
+            const unsigned int j = __builtin_ctz(cand);
+            cand &= cand - 1;
+            tests++;
+            const vec pj = {s->x[j], s->y[j], s->z[j], 0.f};
+            const float d = vDist(pos, pj);
+            if(d < cd)
+            {
+                simCollide(s, i, j, d, cd, &pos, &dir);
+                h = 1;
+
+                // pushed out it could now reach any sphere after j, and every sphere after it must test it
+                pushed |= 1u << i;
+                cand = all & ~((2u << j) - 1) & ~(1u << i);
+            }
+        }
+
+        simSet(s, i, pos, dir);
+        if(hit != NULL){hit[i] = h;}
+    }
+    s->tests = tests;
+}
+
+// a bitmask per sphere of the partners it could reach this step with no square root, only the set bits are measured,
+// spheres outside the unit sphere or pushed out can land anywhere so they test every sphere
+__attribute__((target("avx2")))
+void sim_step_mask(sim* s, unsigned char* hit)
+{
+    if(s->n > SIM_MASK_MAX)
+    {
+        sim_step_avx2(s, hit);
+        return;
+    }
+    simStepMask(s, hit, s->n, s->np);
+}
+
+// the same kernels with the sphere count a constant so the loops over it unroll and the masks fold, simSelectStep() picks them
+#define SIM_STEP_FIXED(kernel, body, N) \
+    __attribute__((target("avx2"))) static void kernel##_##N(sim* s, unsigned char* hit){body(s, hit, N, (N + SIM_LANES-1) & ~(SIM_LANES-1));}
+SIM_STEP_FIXED(sim_step_mask, simStepMask, 8)
+SIM_STEP_FIXED(sim_step_mask, simStepMask, 16)
+SIM_STEP_FIXED(sim_step_mask, simStepMask, 32)
+SIM_STEP_FIXED(sim_step_avx2, simStepAvx2, 64)
+
+__attribute__((target("avx2")))
+void sim_step_pairs_avx2(sim* s, unsigned char* hit)
+{
+    simPairsBegin(s);
+    const float cd = s->scale*1.8f;
+    const __m256 cdv = _mm256_set1_ps(cd);
+    uint64_t tests = 0;
+    for(unsigned int i = 0; i < s->n; i++)
+    {
+        const vec pi = {s->x[i], s->y[i], s->z[i], 0.f};
+        const __m256 px = _mm256_set1_ps(pi.x), py = _mm256_set1_ps(pi.y), pz = _mm256_set1_ps(pi.z);
+
+        // start at the block holding i+1 with the lanes up to and including i masked off
+        unsigned int j = (i+1) & ~(SIM_LANES-1);
+        unsigned int skip = (i+1) % SIM_LANES != 0 ? (2u << (i - j)) - 1 : 0;
+        for(; j < s->np; j += SIM_LANES, skip = 0)
+        {
+            unsigned int m = sim_pair_mask8(s, j, px, py, pz, cdv) & ~skip;
+            tests += SIM_LANES;
+            while(m != 0)
+            {
+                const unsigned int k = __builtin_ctz(m);
+                m &= m-1;
+                const vec pj = {s->x[j+k], s->y[j+k], s->z[j+k], 0.f};
+                simPairCollide(s, i, j+k, vDist(pi, pj), cd);
+            }
+        }
+    }
+    s->tests = tests;
+    simPairsApply(s, hit);
+}
+
+#endif
+
+sim_step_fn simSelectStep(const unsigned int n)
+{
+    if(n >= SIM_GRID_MIN)
+        return sim_step_grid;
+#ifndef NOSSE
+    if(__builtin_cpu_supports("avx2"))
+    {
+        if(n == 8){return sim_step_mask_8;}
+        if(n == 16){return sim_step_mask_16;}
+        if(n == 32){return sim_step_mask_32;}
+        if(n == 64){return sim_step_avx2_64;}
+        return n <= SIM_MASK_MAX ? sim_step_mask : sim_step_avx2;
+    }
+#endif
+    return sim_step;
+}
+
+sim_step_fn simSelectPairs(const unsigned int n)
+{
+    if(n >= SIM_GRID_MIN)
+        return sim_step_pairs_grid;
+#ifndef NOSSE
+    if(__builtin_cpu_supports("avx2"))
+        return sim_step_pairs_avx2;
+#endif
+    return sim_step_pairs;
+}
+
+#endif
@@ -12,6 +12,7 @@
 #include <string.h>
 
 // #define NOSSE
+// #define VEC_STRICT  // exact square roots in place of the SSE estimate, the same result on every x86
 #if !defined(__linux__) || defined(NOSSE)
     #define SEIR_RAND
 #endif
@@ -86,7 +87,7 @@ void vMulS(vec* r, const vec v1, const float v2);
 
 static inline float rsqrtss(float f)
 {
-#ifdef NOSSE
+#if defined(NOSSE) || defined(VEC_STRICT)
     return 1.f/sqrtf(f);
 #else
     return _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(f)));
@@ -29,6 +29,9 @@
         N = New simulation.
         F = FPS to console.
         P = Toggle CPU and NEURAL modes.
+        B = Toggle waiting for each prediction from pred.py or using the latest.
+        S = Save the state to uc.snap, each press adds one.
+        L = Load the states of uc.snap in turn.
         
 */
 
@@ -61,6 +64,12 @@
 #define SEIR_RAND
 
 #include "inc/esAux2.h"
+#include "inc/sim.h"
+#include "inc/event.h"
+#include "inc/dsfile.h"
+#include "inc/snap.h"
+#include "inc/mlp.h"
+#include "inc/bridge.h"
 
 #include "inc/res.h"
 #include "inc/low.h"
@@ -106,7 +115,6 @@ ESModel mdlSphere;
 
 // game vars
 #define FAR_DISTANCE 1000.f
-#define MAX_SPHERES  16
 uint RENDER_PASS = 0;
 double st=0; // start time
 char tts[32];// time taken string
@@ -122,8 +130,20 @@ f32 zoom = -3.3f;
 f32 SPHERE_SCALE = 0.16f;
 f32 SPHERE_SPEED = 0.003f;
 
-typedef struct{vec pos, dir; unsigned char c;} sphere;
-sphere spheres[MAX_SPHERES];
+uint num_spheres = 16;
+sim spheres;
+philox rng; // stream 1 of the sim seed, for the O key
+uint64_t sim_steps = 0; // since the start of the sim
+uint64_t snap_next = 0; // record of uc.snap the L key loads
+sim_step_fn step;
+uint pair_sim = 0; // 1 = sim_step_pairs(), each pair once against a snapshot of the step
+simevent events;
+uint event_sim = 0; // 1 = event driven engine, inc/event.h
+unsigned char* scol; // 1 = render red
+f32 *nin, *nout;     // neural bridge buffers
+mlp net;             // in-process network, net.layers = 0 uses the pred.py bridge
+bridge predlink;     // shared memory rings to pred.py
+uint bridge_block = 0; // 1 = wait for the prediction of each step, 0 = use the latest there is
 
 uint neural_sim = 0;
 
@@ -251,13 +271,47 @@ void newSim()
     
     glfwSetWindowTitle(window, "UnitCollider");
     
-    for(uint i = 0; i < MAX_SPHERES; i++)
+    simRandomStream(&spheres, (uint)seed, 0); // the same start as ucc -d seed -j 1
+    pxSeed(&rng, (uint)seed, 1);
+    sim_steps = 0;
+    memset(scol, 0, num_spheres);
+    if(event_sim == 1){evSync(&events);}
+}
+
+// append the state to uc.snap, for ucc -i or the L key
+void saveSnap()
+{
+    snapheader h = {0};
+    h.spheres = num_spheres;
+    h.physics = event_sim == 1 ? DS_PHYSICS_EVENTS : pair_sim == 1 ? DS_PHYSICS_PAIRS : DS_PHYSICS_ORDERED;
+    h.scale = SPHERE_SCALE;
+    h.speed = SPHERE_SPEED;
+    char strts[16];
+    timestamp(&strts[0]);
+    if(snapAppend("uc.snap", &h, &spheres, sim_steps, &rng) < 0)
+        printf("[%s] Failed to save to uc.snap, it may hold another sphere count.\n", strts);
+    else
+        printf("[%s] Saved step %lu to uc.snap.\n", strts, sim_steps);
+}
+
+// load the snapshots of uc.snap in turn
+void loadSnap()
+{
+    char strts[16];
+    timestamp(&strts[0]);
+    snapfile f;
+    if(snapOpen(&f, "uc.snap") < 0){printf("[%s] There is no uc.snap.\n", strts); return;}
+    if(snap_next >= f.h.count){snap_next = 0;}
+    if(snapGet(&f, snap_next, &spheres, &sim_steps, &rng) < 0)
+        printf("[%s] uc.snap is for %u spheres.\n", strts, f.h.spheres);
+    else
     {
-        vRuvTA(&spheres[i].pos); // random point on inside of unit sphere
-        vRuvBT(&spheres[i].dir); // random point on outside of unit sphere
-        vNorm(&spheres[i].dir); // hmm or not?
-        spheres[i].c = 0.f;
+        printf("[%s] Loaded %lu of %lu from uc.snap, step %lu.\n", strts, snap_next+1, f.h.count, sim_steps);
+        snap_next++;
+        memset(scol, 0, num_spheres);
+        if(event_sim == 1){evSync(&events);}
     }
+    snapClose(&f);
 }
 
 //*************************************
@@ -311,66 +365,72 @@ void main_loop()
 
     if(neural_sim == 1)
     {
-        // write input to file
-        FILE *f = fopen("/dev/shm/uc_input.dat", "wb");
-        if(f != NULL)
+        for(uint i = 0; i < num_spheres; i++)
         {
-            float input[96];
-            for(uint i = 0; i < MAX_SPHERES; i++)
-            {
-                const uint ofs = i * 6;
-                input[ofs]   = spheres[i].pos.x;
-                input[ofs+1] = spheres[i].pos.y;
-                input[ofs+2] = spheres[i].pos.z;
-                input[ofs+3] = spheres[i].dir.x;
-                input[ofs+4] = spheres[i].dir.y;
-                input[ofs+5] = spheres[i].dir.z;
-            }
-            if(fwrite(&input[0], sizeof(float), 96, f) != 96)
-                printf("ERROR: neural write failed.\n");
-            fclose(f);
+            const uint ofs = i * 6;
+            nin[ofs]   = spheres.x[i];
+            nin[ofs+1] = spheres.y[i];
+            nin[ofs+2] = spheres.z[i];
+            nin[ofs+3] = spheres.dx[i];
+            nin[ofs+4] = spheres.dy[i];
+            nin[ofs+5] = spheres.dz[i];
         }
 
-        // load last result
-        float ret[48];
-        f = fopen("/dev/shm/uc_r.dat", "rb");
-        if(f != NULL)
+        uint have = 0;
+        if(net.layers > 0)
         {
-            if(fread(&ret, sizeof(float), 48, f) == 48)
+            // synchronous, the result is for this very step
+            mlpRun(&net, nin, nout);
+            have = 1;
+        }
+        else if(predlink.h != NULL)
+        {
+            // hand the step to pred.py, then wait for its answer or take the newest answer there is
+            const int64_t id = bridgeSend(&predlink, nin);
+            if(bridge_block == 1 && id >= 0)
+                have = bridgeWait(&predlink, id, nout, 100);
+            else
+                have = bridgeLatest(&predlink, nout);
+        }
+
+        f32* ret = nout;
+        if(have == 1)
+        {
+            // cant just dump the buffer, need to check norm and generate directions
+            for(uint i = 0; i < num_spheres; i++)
             {
-                // cant just dump the buffer, need to check norm and generate directions
-                for(uint i = 0; i < MAX_SPHERES; i++)
+                const uint ofs = i*3;
+                if(isnorm(ret[ofs]) == 0 || isnorm(ret[ofs+1]) == 0 || isnorm(ret[ofs+2]) == 0){continue;}
+
+                scol[i] = 0;
+
+                vec pos, dir;
+                simGet(&spheres, i, &pos, &dir);
+
+                // new dir
+                vec nd;
+                nd.x = ret[ofs];
+                nd.y = ret[ofs+1];
+                nd.z = ret[ofs+2];
+                
+                // const f32 ndm = vMag(nd);
+                // static f32 h1 = 0.f, h2 = 0.f;
+                // if(ndm > h1)
+                //     h1 = ndm;
+                // if(nd.x+nd.y+nd.z > h2)
+                //     h2 = nd.x+nd.y+nd.z;
+                // printf("%f %f\n", h1, h2);
+
+                // printf("%f %f\n", ndm, nd.x+nd.y+nd.z);
+                if(nd.x+nd.y+nd.z >= 0.002f)
                 {
-                    const uint ofs = i*3;
-                    if(isnorm(ret[ofs]) == 0 || isnorm(ret[ofs+1]) == 0 || isnorm(ret[ofs+2]) == 0){continue;}
-
-                    spheres[i].c = 0;
-
-                    // new dir
-                    vec nd;
-                    nd.x = ret[ofs];
-                    nd.y = ret[ofs+1];
-                    nd.z = ret[ofs+2];
-                    
-                    // const f32 ndm = vMag(nd);
-                    // static f32 h1 = 0.f, h2 = 0.f;
-                    // if(ndm > h1)
-                    //     h1 = ndm;
-                    // if(nd.x+nd.y+nd.z > h2)
-                    //     h2 = nd.x+nd.y+nd.z;
-                    // printf("%f %f\n", h1, h2);
-
-                    // printf("%f %f\n", ndm, nd.x+nd.y+nd.z);
-                    if(nd.x+nd.y+nd.z >= 0.002f)
-                    {
-                        // printf("%f\n", nd.x+nd.y+nd.z);
-                        spheres[i].c = 1;
-                        spheres[i].dir = nd;
-                        vNorm(&spheres[i].dir);
-                    }
+                    // printf("%f\n", nd.x+nd.y+nd.z);
+                    scol[i] = 1;
+                    dir = nd;
+                    vNorm(&dir);
+                    simSet(&spheres, i, pos, dir);
                 }
             }
-            fclose(f);
         }
     }
 
@@ -380,78 +440,36 @@ void main_loop()
     if(RENDER_PASS == 1)
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     
-    for(uint i = 0; i < MAX_SPHERES; i++)
+    if(neural_sim == 0)
     {
-        if(RENDER_PASS == 1)
-        {
-            if(spheres[i].c == 0)
-                glUniform3f(color_id, 0.f, 0.f, 1.f);
-            else
-                glUniform3f(color_id, 1.f, 0.f, 0.f);
-        }
-
-        vec inc;
-        vMulS(&inc, spheres[i].dir, SPHERE_SPEED);
-        vAdd(&spheres[i].pos, spheres[i].pos, inc);
-
-        const f32 mod = vMod(spheres[i].pos);
-        if(mod > 1.f)
+        if(event_sim == 1){evStep(&events, scol);}
+        else{step(&spheres, scol);}
+    }
+    else
+    {
+        // neural sim only computes collisions
+        for(uint i = 0; i < num_spheres; i++)
         {
-            vec sd = spheres[i].pos;
-            vNorm(&sd);
-
-            vReflect(&spheres[i].dir, spheres[i].dir, sd);
-            vNorm(&spheres[i].dir); // hmm or not?
-
-            vec ob = spheres[i].pos;
-            vNorm(&ob);
-            vInv(&ob);
-
-            vec inc;
-            vMulS(&inc, ob, (mod-1.f)+SPHERE_SPEED);
-            // vMulS(&inc, spheres[i].dir, (mod-1.f)+SPHERE_SPEED);
-            vAdd(&spheres[i].pos, spheres[i].pos, inc);
+            vec pos, dir;
+            simGet(&spheres, i, &pos, &dir);
+            simMoveWall(&spheres, &pos, &dir);
+            simSet(&spheres, i, pos, dir);
         }
-
-        if(neural_sim == 0) // neural sim only computes collisions
-        {
-            for(uint j = 0; j < MAX_SPHERES; j++)
-            {
-                if(j == i){continue;} // dont collide with self
-
-                const f32 d = vDist(spheres[i].pos, spheres[j].pos);
-                const f32 cd = SPHERE_SCALE*1.8f;
-                if(d < cd)
-                {
-                    if(RENDER_PASS == 1){glUniform3f(color_id, 1.f, 0.f, 0.f);}
-
-                    // vec sdj = spheres[j].pos;
-                    // vNorm(&sdj);
-                    // vReflect(&spheres[i].dir, sdj, spheres[i].dir);
-                    // vNorm(&spheres[i].dir);
-                    
-                    // reflect the ball direction
-                    vReflect(&spheres[i].dir, spheres[j].dir, spheres[i].dir);
-                    vNorm(&spheres[i].dir);
-
-                    // increment the ball to a non-intersecting distance in the new direction
-                    vec inc;
-                    vMulS(&inc, spheres[i].dir, (cd-d)+SPHERE_SPEED);
-                    vAdd(&spheres[i].pos, spheres[i].pos, inc);
-
-                    // char strts[16];
-                    // timestamp(&strts[0]);
-                    // printf("[%s] Collision %f.\n", strts, d);
-                }
-            }
-        }
-        
-        if(RENDER_PASS == 1)
-            rSphere(spheres[i].pos.x, spheres[i].pos.y, spheres[i].pos.z);
     }
+    sim_steps++;
 
     if(RENDER_PASS == 1)
+    {
+        for(uint i = 0; i < num_spheres; i++)
+        {
+            if(scol[i] == 0)
+                glUniform3f(color_id, 0.f, 0.f, 1.f);
+            else
+                glUniform3f(color_id, 1.f, 0.f, 0.f);
+            rSphere(spheres.x[i], spheres.y[i], spheres.z[i]);
+        }
         glfwSwapBuffers(window);
+    }
 }
 
 //*************************************
@@ -495,14 +513,53 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
         // orbit in
         else if(key == GLFW_KEY_O)
         {
-            for(uint i = 0; i < MAX_SPHERES; i++)
+            pxRuv(&rng, spheres.x, spheres.y, spheres.z, num_spheres); // random points on outside of unit sphere
+            pxRuv(&rng, spheres.dx, spheres.dy, spheres.dz, num_spheres);
+            for(uint i = 0; i < num_spheres; i++)
+            {
+                const f32 d = (pxRandf(&rng)*0.3f)+1.2f; // project it away from the unit sphere a little
+                spheres.x[i] *= d, spheres.y[i] *= d, spheres.z[i] *= d;
+            }
+            memset(scol, 0, num_spheres);
+            if(event_sim == 1){evSync(&events);}
+        }
+
+        // save and load snapshots
+        else if(key == GLFW_KEY_S){saveSnap();}
+        else if(key == GLFW_KEY_L){loadSnap();}
+
+        // toggle waiting on pred.py
+        else if(key == GLFW_KEY_B)
+        {
+            bridge_block = 1 - bridge_block;
+            char strts[16];
+            timestamp(&strts[0]);
+            printf("[%s] Predictions: %s\n", strts, bridge_block == 1 ? "wait for each step" : "latest available");
+        }
+
+        // toggle once per pair collisions
+        else if(key == GLFW_KEY_Y)
+        {
+            pair_sim = 1 - pair_sim;
+            step = pair_sim == 1 ? simSelectPairs(num_spheres) : simSelectStep(num_spheres);
+            char strts[16];
+            timestamp(&strts[0]);
+            printf("[%s] Collisions: %s\n", strts, pair_sim == 1 ? "once per pair" : "ordered");
+        }
+
+        // toggle the event driven engine
+        else if(key == GLFW_KEY_E)
+        {
+            if(event_sim == 0 && events.s == NULL && evInit(&events, &spheres) < 0)
             {
-                vRuvBT(&spheres[i].pos); // random point on outside of unit sphere
-                vMulS(&spheres[i].pos, spheres[i].pos, (randf()*0.3f)+1.2f); // project it away from the unit sphere a little
-                vRuvBT(&spheres[i].dir); // random point on outside of unit sphere
-                vNorm(&spheres[i].dir); // hmm or not?
-                spheres[i].c = 0.f;
+                printf("evInit() failed.\n");
+                return;
             }
+            event_sim = 1 - event_sim;
+            if(event_sim == 1 && evSync(&events) == 1){printf("The spheres are too dense to separate, some will start overlapping.\n");}
+            char strts[16];
+            timestamp(&strts[0]);
+            printf("[%s] Engine: %s\n", strts, event_sim == 1 ? "event driven" : "stepped");
         }
 
         // toggle neural sim
@@ -524,8 +581,10 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
                 printf("[%s] Neural sim: OFF\n", strts);
 
                 // reset neural colours
-                for(uint i = 0; i < MAX_SPHERES; i++)
-                    spheres[i].c = 0.f;
+                memset(scol, 0, num_spheres);
+
+                // carry on from where the network left the spheres
+                if(event_sim == 1){evSync(&events);}
             }
         }
     }
@@ -603,16 +662,38 @@ int main(int argc, char** argv)
     // set neural_sim
     if(argc >= 4){neural_sim = atoi(argv[3]);}
 
+    // sphere count, the neural models are trained on 16
+    if(argc >= 5){num_spheres = atoi(argv[4]);}
+    if(num_spheres < 1){num_spheres = 1;}
+
+    // a .mlp from export.py runs the network in-process instead of through pred.py
+    if(argc >= 6)
+    {
+        if(mlpLoad(&net, argv[5]) < 0){printf("mlpLoad() failed, %s is not a .mlp file.\n", argv[5]); exit(EXIT_FAILURE);}
+        if(net.in != num_spheres*6 || net.out != num_spheres*3){printf("%s is for %u spheres.\n", argv[5], net.in/6); exit(EXIT_FAILURE);}
+    }
+    else if(bridgeOpen(&predlink, "/uc_bridge", num_spheres*6, num_spheres*3) < 0)
+        printf("bridgeOpen() failed, neural mode needs a .mlp.\n");
+
     // help
     printf("----\n");
     printf("UnitCollider\n");
     printf("----\n");
     printf("James William Fletcher (github.com/mrbid)\n");
     printf("----\n");
-    printf("Argv(2): msaa, maxfps\n");
-    printf("e.g; ./uc 16 60\n");
+    printf("Argv(5): msaa, maxfps, neural, spheres, model.mlp\n");
+    printf("e.g; ./uc 16 60 0 16\n");
+    printf("e.g; ./uc 16 60 1 16 selu_adam_32_16_16.mlp\n");
     printf("----\n");
 
+    // sim state
+    if(simInit(&spheres, num_spheres, SPHERE_SCALE, SPHERE_SPEED) < 0){printf("simInit() failed.\n"); exit(EXIT_FAILURE);}
+    step = simSelectStep(num_spheres);
+    scol = calloc(num_spheres, 1);
+    nin = malloc(num_spheres*6*sizeof(f32));
+    nout = malloc(num_spheres*3*sizeof(f32));
+    if(scol == NULL || nin == NULL || nout == NULL){printf("malloc() failed.\n"); exit(EXIT_FAILURE);}
+
     // init glfw
     if(!glfwInit()){printf("glfwInit() failed.\n"); exit(EXIT_FAILURE);}
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
@@ -18,6 +18,7 @@ from sys import exit
 from os.path import isfile
 from os import mkdir
 from os.path import isdir
+import dataset
 
 # import tensorflow as tf
 # from tensorflow.python.client import device_lib
@@ -38,8 +39,9 @@ seed(74035)
 model_name = 'keras_model'
 shuffled = ''
 optimiser = 'adam'
-inputsize = 96
-outputsize = 48
+spheres = int(os.environ.get('SPHERES', 16)) # must match the generator (ucc -n)
+inputsize = spheres*6
+outputsize = spheres*3
 training_iterations = 1
 activator = 'tanh'
 layers = 3
@@ -70,10 +72,6 @@ if argc >= 7 and sys.argv[6] == '1':
 # make sure save dir exists
 if not isdir('models'): mkdir('models')
 
-# training set size
-tss = int(os.stat("dataset_y.dat").st_size / 192)
-print("Dataset Size:", "{:,}".format(tss))
-
 ##########################################
 #   LOAD DATA
 ##########################################
@@ -90,13 +88,9 @@ if isfile("numpy_x.npy"):
     model_name = 'models/' + activator + '_' + optimiser + '_' + sys.argv[1] + '_' + sys.argv[2] + '_' + sys.argv[3] + '_shuf'
     print("model_name:", model_name)
 else:
-    with open("dataset_x.dat", 'rb') as f:
-        data = np.fromfile(f, dtype=np.float32)
-        train_x = np.reshape(data, [tss, inputsize])
-
-    with open("dataset_y.dat", 'rb') as f:
-        data = np.fromfile(f, dtype=np.float32)
-        train_y = np.reshape(data, [tss, outputsize])
+    train_x, train_y = dataset.read(inputsize, outputsize)
+    tss = train_x.shape[0]
+    print("Dataset Size:", "{:,}".format(tss))
 
     print("Loaded regular arrays; no shuffle")
     model_name = 'models/' + activator + '_' + optimiser + '_' + sys.argv[1] + '_' + sys.argv[2] + '_' + sys.argv[3]
@@ -0,0 +1,422 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Info:
+
+        Headless benchmark of the physics step.
+
+        Sweeps every combination of the sphere counts, scales, speeds,
+        thread counts and step engines given and for each one steps
+        fresh random universes with no rendering and no file output,
+        then reports universe steps/sec, pair tests/sec, collisions/sec
+        and ns per sphere-step as the mean and standard deviation over
+        a number of timed trials.
+
+        Engines:
+            scalar  sim_step(), the original loop
+            avx2    sim_step_avx2(), 8 partners per instruction
+            mask    sim_step_mask(), partner bitmasks up to 32 spheres
+            select  simSelectStep(), the kernel ucc and uc use, fixed to
+                    the sphere count for 8, 16, 32 and 64
+            grid    sim_step_grid(), uniform grid broad phase
+            batch   sim_step_batch(), -k universes in lockstep
+            pairs   sim_step_pairs(), each pair once against a snapshot
+            pairs-avx2, pairs-grid  the same with avx2 and the grid
+            events  evStep(), event driven, sampled every step
+            verlet  sim_step_verlet(), neighbour lists with a skin
+            pairs-morton  pairs-grid with the spheres sorted into
+                    Morton order every -m steps
+            advance sim_advance(), -a steps at a time jumping over
+                    free flight, select for the rest
+
+        Each thread steps its own universes, the ns per sphere-step is
+        wall time over every sphere-step of every thread so it is the
+        per core cost with one thread and the throughput with more.
+        Pair tests are the distances each kernel really tests, every
+        lane for the avx2 kernels and the bitmask pass as well for mask.
+        They are N*(N-1) per step for scalar and batch and half that
+        for pairs. advance has no count of its own, the table shows -
+        and the JSON leaves pair_tests_per_sec out. A collision is a
+        sphere that hit another in a step, or in -a steps for advance.
+
+        The results are written as JSON (-o) so runs can be kept and
+        compared to catch regressions.
+
+        e.g; ./ubench -n 16,64,256,1024 -e scalar,avx2,grid -o bench.json
+
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../inc/vec.h"
+#include "../inc/sim.h"
+#include "../inc/batch.h"
+#include "../inc/event.h"
+
+#define f32 float
+
+#ifndef __x86_64__
+    #define NOSSE
+#endif
+
+//*************************************
+// globals
+//*************************************
+#define MAX_SWEEP 32
+enum{ENGINE_SCALAR, ENGINE_AVX2, ENGINE_GRID, ENGINE_BATCH, ENGINE_PAIRS, ENGINE_PAIRS_AVX2, ENGINE_PAIRS_GRID, ENGINE_EVENTS, ENGINE_VERLET, ENGINE_PAIRS_MORTON, ENGINE_MASK, ENGINE_SELECT, ENGINE_ADVANCE, ENGINES};
+const char* engine_names[] = {"scalar", "avx2", "grid", "batch", "pairs", "pairs-avx2", "pairs-grid", "events", "verlet", "pairs-morton", "mask", "select", "advance"};
+
+uint STEPS = 2000;   // steps per trial
+uint WARMUP = 200;   // untimed steps before the first trial
+uint TRIALS = 5;
+uint UNIVERSES = 64; // per thread for the batch engine
+uint REORDER = 64;   // steps between reorders for pairs-morton
+uint ADVANCE = 64;   // steps per sim_advance() for advance
+
+typedef struct
+{
+    pthread_t tid;
+    uint engine;
+    sim_step_fn select;  // for ENGINE_SELECT and ENGINE_ADVANCE
+    sim s;
+    simbatch b;
+    simevent ev;
+    unsigned char* hit;
+    uint steps;          // since the last reorder
+    uint64_t tests;      // pair tests this trial
+    uint64_t collisions; // spheres that hit another this trial
+} worker;
+
+pthread_barrier_t start_line, finish_line;
+volatile int quit = 0;
+uint num_workers = 0;
+worker* workers;
+
+//*************************************
+// utility functions
+//*************************************
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// comma separated list, returns the count
+uint parseList(const char* s, double* r)
+{
+    uint n = 0;
+    while(*s != 0 && n < MAX_SWEEP)
+    {
+        char* e;
+        r[n++] = strtod(s, &e);
+        if(e == s){return 0;}
+        s = *e == ',' ? e+1 : e;
+    }
+    return n;
+}
+
+uint parseEngines(const char* s, uint* r)
+{
+    uint n = 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", s);
+    for(char* t = strtok(buf, ","); t != NULL && n < MAX_SWEEP; t = strtok(NULL, ","))
+    {
+        uint e = 0;
+        while(e < ENGINES && strcmp(t, engine_names[e]) != 0){e++;}
+        if(e == ENGINES){return 0;}
+        r[n++] = e;
+    }
+    return n;
+}
+
+void stats(const double* v, const uint n, double* mean, double* sd, double* min, double* max)
+{
+    *mean = 0, *min = v[0], *max = v[0];
+    for(uint i = 0; i < n; i++)
+    {
+        *mean += v[i];
+        if(v[i] < *min){*min = v[i];}
+        if(v[i] > *max){*max = v[i];}
+    }
+    *mean /= n;
+    *sd = 0;
+    for(uint i = 0; i < n; i++){*sd += (v[i] - *mean)*(v[i] - *mean);}
+    *sd = n > 1 ? sqrt(*sd / (n-1)) : 0;
+}
+
+void jsonStat(FILE* f, const char* name, const double* v, const uint n)
+{
+    double mean, sd, min, max;
+    stats(v, n, &mean, &sd, &min, &max);
+    fprintf(f, "\"%s\": {\"mean\": %.6g, \"stddev\": %.6g, \"min\": %.6g, \"max\": %.6g}", name, mean, sd, min, max);
+}
+
+//*************************************
+// workers
+//*************************************
+void stepWorker(worker* w, const uint steps, const uint count)
+{
+    const uint n = w->engine == ENGINE_BATCH ? w->b.n : w->s.n;
+    const uint cells = w->engine == ENGINE_BATCH ? w->b.k*n : n;
+    for(uint k = 0; k < steps; k++)
+    {
+        if(w->engine == ENGINE_SCALAR){sim_step(&w->s, w->hit);}
+#ifndef NOSSE
+        else if(w->engine == ENGINE_AVX2){sim_step_avx2(&w->s, w->hit);}
+        else if(w->engine == ENGINE_MASK){sim_step_mask(&w->s, w->hit);}
+#endif
+        else if(w->engine == ENGINE_SELECT){w->select(&w->s, w->hit);} // simSelectStep() falls back to sim_step() without avx2
+        else if(w->engine == ENGINE_GRID){sim_step_grid(&w->s, w->hit);}
+        else if(w->engine == ENGINE_PAIRS){sim_step_pairs(&w->s, w->hit);}
+#ifndef NOSSE
+        else if(w->engine == ENGINE_PAIRS_AVX2){sim_step_pairs_avx2(&w->s, w->hit);}
+#endif
+        else if(w->engine == ENGINE_PAIRS_GRID){sim_step_pairs_grid(&w->s, w->hit);}
+        else if(w->engine == ENGINE_EVENTS){evStep(&w->ev, w->hit);}
+        else if(w->engine == ENGINE_VERLET){sim_step_verlet(&w->s, w->hit);}
+        else if(w->engine == ENGINE_ADVANCE)
+        {
+            const uint a = steps - k < ADVANCE ? steps - k : ADVANCE;
+            sim_advance(&w->s, a, w->select, w->hit);
+            k += a-1;
+        }
+        else if(w->engine == ENGINE_PAIRS_MORTON)
+        {
+            if(++w->steps == REORDER)
+            {
+                simReorder(&w->s);
+                w->steps = 0;
+            }
+            sim_step_pairs_grid(&w->s, w->hit);
+        }
+        else{sim_step_batch(&w->b, w->hit);}
+
+        if(count == 0){continue;}
+        for(uint i = 0; i < cells; i++){w->collisions += w->hit[i];}
+        if(w->engine == ENGINE_GRID || w->engine == ENGINE_PAIRS_GRID || w->engine == ENGINE_PAIRS_MORTON){w->tests += w->s.grid.tests;}
+        else if(w->engine == ENGINE_SELECT && w->select == sim_step_grid){w->tests += w->s.grid.tests;} // simSelectStep() picks the grid from SIM_GRID_MIN spheres
+        else if(w->engine == ENGINE_VERLET){w->tests += w->s.verlet.tests;}
+        else if(w->engine == ENGINE_EVENTS || w->engine == ENGINE_ADVANCE){} // evStep() counts its own, sim_advance() has none
+        else if(w->engine == ENGINE_AVX2 || w->engine == ENGINE_MASK || w->engine == ENGINE_PAIRS_AVX2 || (w->engine == ENGINE_SELECT && w->select != sim_step)){w->tests += w->s.tests;}
+        else if(w->engine == ENGINE_PAIRS){w->tests += (uint64_t)n * (n-1) / 2;}
+        else{w->tests += (uint64_t)cells * (n-1);}
+    }
+}
+
+void* workerMain(void* arg)
+{
+    worker* w = arg;
+    stepWorker(w, WARMUP, 0);
+    while(1)
+    {
+        pthread_barrier_wait(&start_line);
+        if(quit == 1){break;}
+        w->tests = w->collisions = w->ev.tests = 0;
+        stepWorker(w, STEPS, 1);
+        if(w->engine == ENGINE_EVENTS){w->tests = w->ev.tests;}
+        pthread_barrier_wait(&finish_line);
+    }
+    return NULL;
+}
+
+//*************************************
+// Process Entry Point
+//*************************************
+int main(int argc, char** argv)
+{
+    double spheres[MAX_SWEEP] = {16, 64, 256, 1024}, scales[MAX_SWEEP] = {0.16}, speeds[MAX_SWEEP] = {0.003}, threads[MAX_SWEEP] = {1};
+    uint nspheres = 4, nscales = 1, nspeeds = 1, nthreads = 1;
+    uint engines[MAX_SWEEP] = {ENGINE_SCALAR, ENGINE_AVX2, ENGINE_GRID, ENGINE_BATCH, ENGINE_PAIRS, ENGINE_PAIRS_AVX2, ENGINE_PAIRS_GRID, ENGINE_EVENTS, ENGINE_VERLET, ENGINE_PAIRS_MORTON, ENGINE_MASK, ENGINE_SELECT, ENGINE_ADVANCE}, nengines = ENGINES;
+    const char* out = "bench.json";
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:r:p:t:e:s:w:i:k:m:a:o:")) != -1)
+    {
+        uint ok = 1;
+        if(opt == 'n'){ok = (nspheres = parseList(optarg, spheres));}
+        else if(opt == 'r'){ok = (nscales = parseList(optarg, scales));}
+        else if(opt == 'p'){ok = (nspeeds = parseList(optarg, speeds));}
+        else if(opt == 't'){ok = (nthreads = parseList(optarg, threads));}
+        else if(opt == 'e'){ok = (nengines = parseEngines(optarg, engines));}
+        else if(opt == 's'){STEPS = atoi(optarg);}
+        else if(opt == 'w'){WARMUP = atoi(optarg);}
+        else if(opt == 'i'){TRIALS = atoi(optarg);}
+        else if(opt == 'k'){UNIVERSES = atoi(optarg);}
+        else if(opt == 'm'){REORDER = atoi(optarg);}
+        else if(opt == 'a'){ADVANCE = atoi(optarg);}
+        else if(opt == 'o'){out = optarg;}
+        else{ok = 0;}
+        if(ok == 0 || STEPS < 1 || TRIALS < 1 || TRIALS > 1000 || UNIVERSES < 1 || REORDER < 1 || ADVANCE < 1)
+        {
+            printf("Usage: %s [-n spheres] [-r scales] [-p speeds] [-t threads] [-e engines] [-s steps] [-w warmup] [-i trials] [-k universes] [-m steps] [-a steps] [-o file]\n", argv[0]);
+            printf("  -n, -r, -p, -t and -e take comma separated lists and every combination is run\n");
+            printf("  -n spheres    (default 16,64,256,1024)\n");
+            printf("  -r scale      (default 0.16)\n");
+            printf("  -p speed      (default 0.003)\n");
+            printf("  -t threads    (default 1)\n");
+            printf("  -e engines    scalar,avx2,grid,batch,pairs,pairs-avx2,pairs-grid,events,verlet,pairs-morton,mask,select,advance (default all)\n");
+            printf("  -s steps      timed steps per trial (default 2000)\n");
+            printf("  -w warmup     untimed steps first (default 200)\n");
+            printf("  -i trials     (default 5)\n");
+            printf("  -k universes  per thread for the batch engine (default 64)\n");
+            printf("  -m steps      between reorders for pairs-morton (default 64)\n");
+            printf("  -a steps      per call for advance (default 64)\n");
+            printf("  -o file       JSON results (default bench.json)\n");
+            return 1;
+        }
+    }
+
+#ifndef NOSSE
+    const int avx2 = __builtin_cpu_supports("avx2");
+#else
+    const int avx2 = 0;
+#endif
+
+    FILE* f = fopen(out, "w");
+    if(f == NULL)
+    {
+        printf("Failed to open %s.\n", out);
+        return 1;
+    }
+    char ts[32];
+    const time_t tt = time(0);
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", localtime(&tt));
+    fprintf(f, "{\n  \"date\": \"%s\",\n  \"cpus\": %li,\n  \"avx2\": %s,\n", ts, sysconf(_SC_NPROCESSORS_ONLN), avx2 ? "true" : "false");
+    fprintf(f, "  \"steps\": %u,\n  \"warmup\": %u,\n  \"trials\": %u,\n  \"results\": [", STEPS, WARMUP, TRIALS);
+
+    const uint64_t seed = time(0);
+    double* sps = malloc(TRIALS*sizeof(double));
+    double* nss = malloc(TRIALS*sizeof(double));
+    double* pts = malloc(TRIALS*sizeof(double));
+    double* cps = malloc(TRIALS*sizeof(double));
+    if(sps == NULL || nss == NULL || pts == NULL || cps == NULL){return 1;}
+
+    uint first = 1;
+    printf("%-12s %7s %7s %8s %3s %14s %14s %14s %14s\n", "engine", "spheres", "scale", "speed", "thr", "steps/s", "ns/sphere-step", "tests/s", "collisions/s");
+    for(uint e = 0; e < nengines; e++)
+    for(uint a = 0; a < nspheres; a++)
+    for(uint b = 0; b < nscales; b++)
+    for(uint c = 0; c < nspeeds; c++)
+    for(uint d = 0; d < nthreads; d++)
+    {
+        const uint engine = engines[e], n = spheres[a], nt = threads[d];
+        const f32 scale = scales[b], speed = speeds[c];
+        if(n < 1 || nt < 1){continue;}
+        if((engine == ENGINE_AVX2 || engine == ENGINE_PAIRS_AVX2 || engine == ENGINE_MASK) && avx2 == 0){continue;}
+        if(engine == ENGINE_MASK && n > SIM_MASK_MAX){continue;}
+        if(engine == ENGINE_EVENTS && n * powf(scale*0.9f, 3.f) > 0.5f){continue;} // hard spheres this dense jam
+        const uint universes = engine == ENGINE_BATCH ? ((UNIVERSES + SIM_LANES-1) & ~(SIM_LANES-1)) : 1;
+
+        // fresh universes for every configuration, one random stream each
+        workers = calloc(nt, sizeof(worker));
+        if(workers == NULL){return 1;}
+        num_workers = nt;
+        for(uint t = 0; t < nt; t++)
+        {
+            worker* w = &workers[t];
+            w->engine = engine;
+            w->select = simSelectStep(n);
+            if(engine == ENGINE_BATCH)
+            {
+                if(simBatchInit(&w->b, n, universes, scale, speed) < 0){return 1;}
+                simBatchRandomStream(&w->b, seed, (uint64_t)t*universes);
+            }
+            else
+            {
+                if(simInit(&w->s, n, scale, speed) < 0){return 1;}
+                simRandomStream(&w->s, seed, t);
+                if(engine == ENGINE_EVENTS && evInit(&w->ev, &w->s) < 0){return 1;}
+            }
+            w->hit = calloc(universes*n, 1);
+            if(w->hit == NULL){return 1;}
+        }
+
+        quit = 0;
+        pthread_barrier_init(&start_line, NULL, nt+1);
+        pthread_barrier_init(&finish_line, NULL, nt+1);
+        for(uint t = 0; t < nt; t++)
+        {
+            if(pthread_create(&workers[t].tid, NULL, workerMain, &workers[t]) != 0)
+            {
+                printf("Failed to create worker thread.\n");
+                return 1;
+            }
+        }
+
+        for(uint i = 0; i < TRIALS; i++)
+        {
+            const double st = now(); // before the barrier, the workers may run the whole trial before this thread is scheduled again
+            pthread_barrier_wait(&start_line);
+            pthread_barrier_wait(&finish_line);
+            const double wall = now() - st;
+
+            uint64_t tests = 0, collisions = 0;
+            for(uint t = 0; t < nt; t++)
+            {
+                tests += workers[t].tests;
+                collisions += workers[t].collisions;
+            }
+            const double usteps = (double)nt * universes * STEPS;
+            sps[i] = usteps / wall;
+            nss[i] = wall*1e9 / (usteps * n);
+            pts[i] = tests / wall;
+            cps[i] = collisions / wall;
+        }
+
+        quit = 1;
+        pthread_barrier_wait(&start_line);
+        for(uint t = 0; t < nt; t++)
+        {
+            pthread_join(workers[t].tid, NULL);
+            if(engine == ENGINE_BATCH){simBatchFree(&workers[t].b);}
+            else{simFree(&workers[t].s);}
+            if(engine == ENGINE_EVENTS){evFree(&workers[t].ev);}
+            free(workers[t].hit);
+        }
+        free(workers);
+        pthread_barrier_destroy(&start_line);
+        pthread_barrier_destroy(&finish_line);
+
+        double m[4], sd[4], mn, mx;
+        stats(sps, TRIALS, &m[0], &sd[0], &mn, &mx);
+        stats(nss, TRIALS, &m[1], &sd[1], &mn, &mx);
+        stats(pts, TRIALS, &m[2], &sd[2], &mn, &mx);
+        stats(cps, TRIALS, &m[3], &sd[3], &mn, &mx);
+        char tps[32] = "-";
+        if(engine != ENGINE_ADVANCE){sprintf(tps, "%.4g", m[2]);}
+        printf("%-12s %7u %7g %8g %3u %14.4g %9.3f ±%4.1f%% %14s %14.4g\n", engine_names[engine], n, scale, speed, nt, m[0], m[1], m[1] > 0 ? 100*sd[1]/m[1] : 0, tps, m[3]);
+
+        fprintf(f, "%s\n    {\"engine\": \"%s\", \"spheres\": %u, \"scale\": %g, \"speed\": %g, \"threads\": %u, \"universes\": %u,\n     ",
+            first == 1 ? "" : ",", engine_names[engine], n, scale, speed, nt, universes);
+        jsonStat(f, "steps_per_sec", sps, TRIALS);
+        fprintf(f, ",\n     ");
+        jsonStat(f, "ns_per_sphere_step", nss, TRIALS);
+        fprintf(f, ",\n     ");
+        if(engine != ENGINE_ADVANCE)
+        {
+            jsonStat(f, "pair_tests_per_sec", pts, TRIALS);
+            fprintf(f, ",\n     ");
+        }
+        jsonStat(f, "collisions_per_sec", cps, TRIALS);
+        fprintf(f, "}");
+        fflush(f);
+        first = 0;
+    }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+    printf("Results written to %s\n", out);
+
+    // done
+    return 0;
+}
@@ -0,0 +1,81 @@
+# James William Fletcher - May 2022
+# https://github.com/mrbid
+#
+# The predictor side of the shared memory bridge in inc/bridge.h.
+#
+# recv() sleeps in futex() until uc publishes a request and returns
+# the newest one, send() publishes the response and wakes uc. Slots
+# are copied out before the tail is advanced and written before the
+# head is, and x86 keeps stores in order and loads in order, so
+# neither side can see a half written slot.
+#
+#   b = bridge.Bridge()
+#   while True:
+#       id, x = b.recv()
+#       b.send(id, model.predict(x))
+import os
+import mmap
+import struct
+import ctypes
+import numpy as np
+from time import sleep
+
+BRIDGE_MAGIC = 0x42524355
+BRIDGE_VERSION = 1
+REQ_HEAD, REQ_TAIL, RESP_HEAD, RESP_TAIL = 64, 128, 192, 256
+SLOTS = 320
+SYS_futex = 202
+FUTEX_WAIT, FUTEX_WAKE = 0, 1
+
+libc = ctypes.CDLL(None, use_errno=True)
+libc.syscall.restype = ctypes.c_long
+
+class Bridge:
+    def __init__(self, file="/dev/shm/uc_bridge"):
+        # uc sets the bridge up, wait for it once at start up
+        while True:
+            try:
+                fd = os.open(file, os.O_RDWR)
+                if os.fstat(fd).st_size >= SLOTS and self.u32(os.pread(fd, 4, 0)) == BRIDGE_MAGIC: break
+                os.close(fd)
+            except FileNotFoundError:
+                pass
+            sleep(0.1)
+        self.m = mmap.mmap(fd, 0)
+        os.close(fd)
+        magic, version, self.in_floats, self.out_floats, self.slots, self.slot_in, self.slot_out = struct.unpack_from('<7I', self.m, 0)
+        if version != BRIDGE_VERSION: raise ValueError("bridge version " + str(version) + " is not supported")
+        self.req = SLOTS
+        self.resp = SLOTS + self.slots*self.slot_in
+        self.word = {o: ctypes.c_uint32.from_buffer(self.m, o) for o in (REQ_HEAD, REQ_TAIL, RESP_HEAD, RESP_TAIL)}
+
+    @staticmethod
+    def u32(b):
+        return struct.unpack('<I', b)[0]
+
+    def futex(self, o, op, v):
+        libc.syscall(SYS_futex, ctypes.c_void_p(ctypes.addressof(self.word[o])), op, v, None, None, 0)
+
+    def recv(self):
+        # blocks until there is a request, skipping any older ones, returns (id, (1, in_floats) array)
+        while True:
+            head = self.word[REQ_HEAD].value
+            tail = self.word[REQ_TAIL].value
+            if head != tail: break
+            self.futex(REQ_HEAD, FUTEX_WAIT, head)
+        s = self.req + ((head - 1) % self.slots)*self.slot_in
+        id = struct.unpack_from('<I', self.m, s)[0]
+        x = np.frombuffer(self.m, dtype=np.float32, count=self.in_floats, offset=s+16).copy()
+        self.word[REQ_TAIL].value = head
+        return id, x.reshape(1, self.in_floats)
+
+    def send(self, id, y):
+        # publishes the response to request id, dropped if uc is not reading them
+        head = self.word[RESP_HEAD].value
+        if (head - self.word[RESP_TAIL].value) & 0xffffffff >= self.slots: return False
+        s = self.resp + (head % self.slots)*self.slot_out
+        struct.pack_into('<I', self.m, s, id)
+        self.m[s+16:s+16+self.out_floats*4] = np.asarray(y, dtype=np.float32).reshape(-1)[:self.out_floats].tobytes()
+        self.word[RESP_HEAD].value = (head + 1) & 0xffffffff
+        self.futex(RESP_HEAD, FUTEX_WAKE, 0x7fffffff)
+        return True
@@ -0,0 +1,46 @@
+# James William Fletcher - May 2022
+# https://github.com/mrbid
+#
+# Flattens a Keras Dense model into the .mlp weight file read by
+# inc/mlp.h so uc can run it in-process rather than through pred.py.
+#
+#   python3 export.py models/MED/selu_adam_32_16_16 selu_adam_32_16_16.mlp
+#   ./uc 16 60 1 16 selu_adam_32_16_16.mlp
+import sys
+import os
+import struct
+import numpy as np
+
+MLP_MAGIC = 0x4C4D4355
+MLP_VERSION = 1
+ACTIVATIONS = {'linear': 0, 'relu': 1, 'elu': 2, 'selu': 3, 'tanh': 4, 'sigmoid': 5, 'softplus': 6, 'softsign': 7, 'swish': 8, 'silu': 8}
+
+def write(file, layers):
+    # layers is a list of (kernel[inputs][outputs], bias[outputs], activation name)
+    with open(file, 'wb') as f:
+        f.write(struct.pack('<4I', MLP_MAGIC, MLP_VERSION, len(layers), layers[0][0].shape[0]))
+        for w, b, act in layers:
+            if act not in ACTIVATIONS: raise ValueError("activation " + act + " is not supported by inc/mlp.h")
+            f.write(struct.pack('<3I', w.shape[0], w.shape[1], ACTIVATIONS[act]))
+            f.write(np.ascontiguousarray(w, dtype='<f4').tobytes())
+            f.write(np.ascontiguousarray(b, dtype='<f4').tobytes())
+
+def layers(model):
+    r = []
+    for l in model.layers:
+        if len(l.get_weights()) == 0: continue # Dropout, InputLayer
+        if l.__class__.__name__ != 'Dense': raise ValueError("layer " + l.name + " is not Dense")
+        w, b = l.get_weights()
+        r.append((w, b, l.activation.__name__))
+    return r
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        print("Usage: python3 export.py <saved model> <out.mlp>")
+        sys.exit(1)
+    os.environ['CUDA_VISIBLE_DEVICES'] = '-1'
+    from tensorflow import keras
+    model = keras.models.load_model(sys.argv[1])
+    l = layers(model)
+    write(sys.argv[2], l)
+    print("Wrote", len(l), "layers,", model.input_shape[1], "inputs,", model.output_shape[1], "outputs to", sys.argv[2])
@@ -0,0 +1,224 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Double-buffered asynchronous file output.
+
+    An astream is an append-only file with two fixed-size buffers,
+    the owner fills one while the background writer thread flushes
+    the other to disk. The owner only ever blocks when it fills a
+    buffer before the writer has finished with the previous one,
+    so disk I/O overlaps the simulation and memory use is constant
+    no matter how long the run is.
+
+    One awriter thread serves any number of streams. A stream must
+    only be filled from one thread.
+
+    asOnWrite() sets a function the writer thread calls with each
+    buffer just before it goes to disk, buffers of a stream arrive
+    in file order so it can checksum or index them off the hot path.
+
+    Requires pthreads
+*/
+
+#ifndef AWRITE_H
+#define AWRITE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef struct astream astream;
+typedef void (*asonwrite)(void* user, const char* buf, const size_t bytes);
+
+typedef struct
+{
+    pthread_t tid;
+    pthread_mutex_t m;
+    pthread_cond_t work;   // a buffer was queued or quit was set
+    pthread_cond_t done;   // a buffer was written
+    astream* head;         // queue of streams with a full buffer
+    astream* tail;
+    int quit;
+} awriter;
+
+struct astream
+{
+    awriter* w;
+    int fd;
+    char* buf[2];
+    size_t len[2];
+    size_t cap;            // bytes per buffer
+    int cur;               // buffer being filled
+    int busy[2];           // queued or being written, guarded by w->m
+    int err;               // a write failed, guarded by w->m
+    astream* next;         // writer queue link
+    asonwrite onwrite;     // called by the writer thread before each write, may be NULL
+    void* user;
+};
+
+int  awInit(awriter* w);
+void awClose(awriter* w); // finishes any queued buffers then stops the thread
+
+int   asOpen(astream* s, awriter* w, const char* file, const size_t cap);
+char* asPtr(astream* s);                  // next free byte of the current buffer
+size_t asFree(const astream* s);          // free bytes in the current buffer
+void  asCommit(astream* s, const size_t bytes); // bytes were written at asPtr()
+int   asSwap(astream* s);                 // queue the current buffer and switch, -1 if a write has failed
+int   asFlush(astream* s);                // queue the current buffer and wait until both are on disk, -1 if a write has failed
+int   asClose(astream* s);                // flush everything and close, -1 if a write has failed
+void  asOnWrite(astream* s, asonwrite fn, void* user);
+
+//
+
+static void* awMain(void* arg)
+{
+    awriter* w = arg;
+    pthread_mutex_lock(&w->m);
+    while(1)
+    {
+        while(w->head == NULL && w->quit == 0)
+            pthread_cond_wait(&w->work, &w->m);
+        if(w->head == NULL){break;} // quit and nothing left to do
+
+        astream* s = w->head;
+        w->head = s->next;
+        if(w->head == NULL){w->tail = NULL;}
+
+        // the buffer that is not being filled is the one to write
+        const int b = 1 - s->cur;
+        pthread_mutex_unlock(&w->m);
+
+        const char* p = s->buf[b];
+        size_t left = s->len[b];
+        if(s->onwrite != NULL){s->onwrite(s->user, p, left);}
+        int err = 0;
+        while(left > 0)
+        {
+            const ssize_t r = write(s->fd, p, left);
+            if(r <= 0){err = 1; break;}
+            p += r;
+            left -= r;
+        }
+
+        pthread_mutex_lock(&w->m);
+        s->len[b] = 0;
+        s->busy[b] = 0;
+        if(err == 1){s->err = 1;}
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->m);
+    return NULL;
+}
+
+int awInit(awriter* w)
+{
+    memset(w, 0, sizeof(awriter));
+    pthread_mutex_init(&w->m, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
+    if(pthread_create(&w->tid, NULL, awMain, w) != 0){return -1;}
+    return 0;
+}
+
+void awClose(awriter* w)
+{
+    pthread_mutex_lock(&w->m);
+    w->quit = 1;
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->m);
+    pthread_join(w->tid, NULL);
+    pthread_mutex_destroy(&w->m);
+    pthread_cond_destroy(&w->work);
+    pthread_cond_destroy(&w->done);
+}
+
+int asOpen(astream* s, awriter* w, const char* file, const size_t cap)
+{
+    memset(s, 0, sizeof(astream));
+    s->w = w;
+    s->cap = cap;
+    s->buf[0] = malloc(cap);
+    s->buf[1] = malloc(cap);
+    s->fd = open(file, O_APPEND | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+    if(s->buf[0] == NULL || s->buf[1] == NULL || s->fd < 0)
+    {
+        free(s->buf[0]);
+        free(s->buf[1]);
+        if(s->fd >= 0){close(s->fd);}
+        return -1;
+    }
+    return 0;
+}
+
+char* asPtr(astream* s)
+{
+    return s->buf[s->cur] + s->len[s->cur];
+}
+
+size_t asFree(const astream* s)
+{
+    return s->cap - s->len[s->cur];
+}
+
+void asCommit(astream* s, const size_t bytes)
+{
+    s->len[s->cur] += bytes;
+}
+
+int asSwap(astream* s)
+{
+    awriter* w = s->w;
+    pthread_mutex_lock(&w->m);
+
+    // wait for the writer to finish with the other buffer
+    while(s->busy[1 - s->cur] == 1)
+        pthread_cond_wait(&w->done, &w->m);
+
+    const int err = s->err;
+    if(s->len[s->cur] > 0)
+    {
+        s->busy[s->cur] = 1;
+        s->cur = 1 - s->cur;
+        s->next = NULL;
+        if(w->tail != NULL){w->tail->next = s;}
+        else{w->head = s;}
+        w->tail = s;
+        pthread_cond_signal(&w->work);
+    }
+    pthread_mutex_unlock(&w->m);
+    return err == 1 ? -1 : 0;
+}
+
+void asOnWrite(astream* s, asonwrite fn, void* user)
+{
+    s->onwrite = fn;
+    s->user = user;
+}
+
+int asFlush(astream* s)
+{
+    asSwap(s);
+
+    // wait until both buffers are on disk
+    awriter* w = s->w;
+    pthread_mutex_lock(&w->m);
+    while(s->busy[0] == 1 || s->busy[1] == 1)
+        pthread_cond_wait(&w->done, &w->m);
+    const int err = s->err;
+    pthread_mutex_unlock(&w->m);
+    return err == 1 ? -1 : 0;
+}
+
+int asClose(astream* s)
+{
+    const int err = asFlush(s);
+    close(s->fd);
+    free(s->buf[0]);
+    free(s->buf[1]);
+    s->buf[0] = s->buf[1] = NULL;
+    return err;
+}
+
+#endif
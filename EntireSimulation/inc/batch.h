@@ -0,0 +1,267 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Many independent unit sphere universes stepped in lockstep.
+
+    Universes are grouped into blocks of SIM_LANES and each lane
+    of an AVX2 register holds the same sphere from a different
+    universe, so every lane follows exactly the same code path and
+    the data dependant branches of the scalar step (the wall
+    reflection and sphere collisions) become masked blends that
+    are only evaluated when at least one lane needs them.
+
+    The lane arithmetic mirrors vec.h operation for operation
+    (including the rsqrt in vNorm and no FMA) so every universe
+    is bit-for-bit identical to stepping it alone with sim_step().
+
+    Memory layout: value[((u / SIM_LANES) * n + i) * SIM_LANES + u % SIM_LANES]
+
+    Requires sim.h
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "sim.h"
+
+typedef struct
+{
+    float *x, *y, *z;    // position
+    float *dx, *dy, *dz; // direction
+    unsigned int n;      // spheres per universe
+    unsigned int k;      // universes, a multiple of SIM_LANES
+    float scale;         // SPHERE_SCALE
+    float speed;         // SPHERE_SPEED
+    int *partner;        // partner[u*n + i] as sim partner, NULL to not record, owned by the caller
+    sim tmp;             // single universe scratch for the scalar fallback
+} simbatch;
+
+int  simBatchInit(simbatch* b, const unsigned int n, const unsigned int k, const float scale, const float speed); // k is rounded up to SIM_LANES
+void simBatchFree(simbatch* b);
+void simBatchRandom(simbatch* b); // each universe in turn exactly as simRandom() would
+void simBatchRandomStream(simbatch* b, const uint64_t seed, const uint64_t stream); // universe u as simRandomStream() would with stream + u
+void simBatchGet(const simbatch* b, const unsigned int u, sim* s);
+void simBatchSet(simbatch* b, const unsigned int u, const sim* s);
+
+// hit[u*n + i] is set to 1 if sphere i of universe u collided this step, hit may be NULL
+void sim_step_batch(simbatch* b, unsigned char* hit);
+
+static inline unsigned int simBatchIndex(const simbatch* b, const unsigned int u, const unsigned int i)
+{
+    return ((u / SIM_LANES) * b->n + i) * SIM_LANES + (u % SIM_LANES);
+}
+
+//
+
+int simBatchInit(simbatch* b, const unsigned int n, const unsigned int k, const float scale, const float speed)
+{
+    memset(b, 0, sizeof(simbatch));
+    b->n = n;
+    b->k = (k + SIM_LANES-1) & ~(SIM_LANES-1);
+    b->scale = scale;
+    b->speed = speed;
+    if(simInit(&b->tmp, n, scale, speed) < 0){return -1;}
+    const size_t bytes = (size_t)b->n * b->k * sizeof(float);
+    float** a[6] = {&b->x, &b->y, &b->z, &b->dx, &b->dy, &b->dz};
+    for(int c = 0; c < 6; c++)
+    {
+        *a[c] = aligned_alloc(32, bytes);
+        if(*a[c] == NULL){simBatchFree(b); return -1;}
+        memset(*a[c], 0, bytes);
+    }
+    return 0;
+}
+
+void simBatchFree(simbatch* b)
+{
+    free(b->x);  free(b->y);  free(b->z);
+    free(b->dx); free(b->dy); free(b->dz);
+    b->x = b->y = b->z = b->dx = b->dy = b->dz = NULL;
+    simFree(&b->tmp);
+}
+
+void simBatchRandom(simbatch* b)
+{
+    for(unsigned int u = 0; u < b->k; u++)
+    {
+        simRandom(&b->tmp);
+        simBatchSet(b, u, &b->tmp);
+    }
+}
+
+void simBatchRandomStream(simbatch* b, const uint64_t seed, const uint64_t stream)
+{
+    for(unsigned int u = 0; u < b->k; u++)
+    {
+        simRandomStream(&b->tmp, seed, stream + u);
+        simBatchSet(b, u, &b->tmp);
+    }
+}
+
+void simBatchGet(const simbatch* b, const unsigned int u, sim* s)
+{
+    for(unsigned int i = 0; i < b->n; i++)
+    {
+        const unsigned int o = simBatchIndex(b, u, i);
+        s->x[i]  = b->x[o],  s->y[i]  = b->y[o],  s->z[i]  = b->z[o];
+        s->dx[i] = b->dx[o], s->dy[i] = b->dy[o], s->dz[i] = b->dz[o];
+    }
+}
+
+void simBatchSet(simbatch* b, const unsigned int u, const sim* s)
+{
+    for(unsigned int i = 0; i < b->n; i++)
+    {
+        const unsigned int o = simBatchIndex(b, u, i);
+        b->x[o]  = s->x[i],  b->y[o]  = s->y[i],  b->z[o]  = s->z[i];
+        b->dx[o] = s->dx[i], b->dy[o] = s->dy[i], b->dz[o] = s->dz[i];
+    }
+}
+
+static void sim_step_batch_scalar(simbatch* b, unsigned char* hit)
+{
+    for(unsigned int u = 0; u < b->k; u++)
+    {
+        simBatchGet(b, u, &b->tmp);
+        b->tmp.partner = b->partner != NULL ? &b->partner[u*b->n] : NULL;
+        sim_step(&b->tmp, hit != NULL ? &hit[u*b->n] : NULL);
+        simBatchSet(b, u, &b->tmp);
+    }
+}
+
+#ifndef NOSSE
+
+// vNorm() across lanes
+__attribute__((target("avx2"), always_inline))
+static inline void simBatchNorm(__m256* x, __m256* y, __m256* z)
+{
+    const __m256 sq = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(*x, *x), _mm256_mul_ps(*y, *y)), _mm256_mul_ps(*z, *z));
+#ifdef VEC_STRICT
+    const __m256 len = _mm256_div_ps(_mm256_set1_ps(1.f), _mm256_sqrt_ps(sq));
+#else
+    const __m256 len = _mm256_rsqrt_ps(sq);
+#endif
+    *x = _mm256_mul_ps(*x, len);
+    *y = _mm256_mul_ps(*y, len);
+    *z = _mm256_mul_ps(*z, len);
+}
+
+// vReflect() across lanes
+__attribute__((target("avx2"), always_inline))
+static inline void simBatchReflect(__m256* rx, __m256* ry, __m256* rz, const __m256 vx, const __m256 vy, const __m256 vz, const __m256 nx, const __m256 ny, const __m256 nz)
+{
+    const __m256 two = _mm256_set1_ps(2.f);
+    const __m256 angle = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, nx), _mm256_mul_ps(vy, ny)), _mm256_mul_ps(vz, nz));
+    *rx = _mm256_sub_ps(vx, _mm256_mul_ps(_mm256_mul_ps(two, nx), angle));
+    *ry = _mm256_sub_ps(vy, _mm256_mul_ps(_mm256_mul_ps(two, ny), angle));
+    *rz = _mm256_sub_ps(vz, _mm256_mul_ps(_mm256_mul_ps(two, nz), angle));
+}
+
+__attribute__((target("avx2")))
+static void sim_step_batch_avx2(simbatch* b, unsigned char* hit)
+{
+    const unsigned int n = b->n;
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 speed = _mm256_set1_ps(b->speed);
+    const __m256 cd = _mm256_set1_ps(b->scale*1.8f);
+
+    for(unsigned int blk = 0; blk < b->k / SIM_LANES; blk++)
+    {
+        const size_t base = (size_t)blk * n * SIM_LANES;
+        float *X = b->x + base, *Y = b->y + base, *Z = b->z + base;
+        float *DX = b->dx + base, *DY = b->dy + base, *DZ = b->dz + base;
+
+        for(unsigned int i = 0; i < n; i++)
+        {
+            const unsigned int o = i * SIM_LANES;
+            __m256 px = _mm256_load_ps(X + o), py = _mm256_load_ps(Y + o), pz = _mm256_load_ps(Z + o);
+            __m256 dx = _mm256_load_ps(DX + o), dy = _mm256_load_ps(DY + o), dz = _mm256_load_ps(DZ + o);
+
+            // move
+            px = _mm256_add_ps(px, _mm256_mul_ps(dx, speed));
+            py = _mm256_add_ps(py, _mm256_mul_ps(dy, speed));
+            pz = _mm256_add_ps(pz, _mm256_mul_ps(dz, speed));
+
+            // reflect off the unit sphere
+            const __m256 mod = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, px), _mm256_mul_ps(py, py)), _mm256_mul_ps(pz, pz)));
+            const __m256 wm = _mm256_cmp_ps(mod, one, _CMP_GT_OQ);
+            if(_mm256_movemask_ps(wm) != 0)
+            {
+                __m256 sx = px, sy = py, sz = pz;
+                simBatchNorm(&sx, &sy, &sz);
+
+                __m256 rx, ry, rz;
+                simBatchReflect(&rx, &ry, &rz, dx, dy, dz, sx, sy, sz);
+                simBatchNorm(&rx, &ry, &rz);
+
+                const __m256 inc = _mm256_add_ps(_mm256_sub_ps(mod, one), speed);
+                const __m256 neg = _mm256_set1_ps(-0.f);
+                const __m256 qx = _mm256_add_ps(px, _mm256_mul_ps(_mm256_xor_ps(sx, neg), inc));
+                const __m256 qy = _mm256_add_ps(py, _mm256_mul_ps(_mm256_xor_ps(sy, neg), inc));
+                const __m256 qz = _mm256_add_ps(pz, _mm256_mul_ps(_mm256_xor_ps(sz, neg), inc));
+
+                dx = _mm256_blendv_ps(dx, rx, wm), dy = _mm256_blendv_ps(dy, ry, wm), dz = _mm256_blendv_ps(dz, rz, wm);
+                px = _mm256_blendv_ps(px, qx, wm), py = _mm256_blendv_ps(py, qy, wm), pz = _mm256_blendv_ps(pz, qz, wm);
+            }
+
+            // collide with the other spheres
+            __m256 hm = _mm256_setzero_ps();
+            for(unsigned int j = 0; j < n; j++)
+            {
+                if(j == i){continue;} // dont collide with self
+
+                const unsigned int p = j * SIM_LANES;
+                const __m256 xm = _mm256_sub_ps(px, _mm256_load_ps(X + p));
+                const __m256 ym = _mm256_sub_ps(py, _mm256_load_ps(Y + p));
+                const __m256 zm = _mm256_sub_ps(pz, _mm256_load_ps(Z + p));
+                const __m256 d = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(xm, xm), _mm256_mul_ps(ym, ym)), _mm256_mul_ps(zm, zm)));
+                const __m256 cm = _mm256_cmp_ps(d, cd, _CMP_LT_OQ);
+                const int c = _mm256_movemask_ps(cm);
+                if(c == 0){continue;}
+                if(b->partner != NULL)
+                    for(unsigned int l = 0; l < SIM_LANES; l++)
+                        if((c >> l) & 1){b->partner[(blk*SIM_LANES + l)*n + i] = j;}
+
+                __m256 rx, ry, rz;
+                simBatchReflect(&rx, &ry, &rz, _mm256_load_ps(DX + p), _mm256_load_ps(DY + p), _mm256_load_ps(DZ + p), dx, dy, dz);
+                simBatchNorm(&rx, &ry, &rz);
+
+                const __m256 inc = _mm256_add_ps(_mm256_sub_ps(cd, d), speed);
+                const __m256 qx = _mm256_add_ps(px, _mm256_mul_ps(rx, inc));
+                const __m256 qy = _mm256_add_ps(py, _mm256_mul_ps(ry, inc));
+                const __m256 qz = _mm256_add_ps(pz, _mm256_mul_ps(rz, inc));
+
+                dx = _mm256_blendv_ps(dx, rx, cm), dy = _mm256_blendv_ps(dy, ry, cm), dz = _mm256_blendv_ps(dz, rz, cm);
+                px = _mm256_blendv_ps(px, qx, cm), py = _mm256_blendv_ps(py, qy, cm), pz = _mm256_blendv_ps(pz, qz, cm);
+                hm = _mm256_or_ps(hm, cm);
+            }
+
+            _mm256_store_ps(X + o, px), _mm256_store_ps(Y + o, py), _mm256_store_ps(Z + o, pz);
+            _mm256_store_ps(DX + o, dx), _mm256_store_ps(DY + o, dy), _mm256_store_ps(DZ + o, dz);
+
+            if(hit != NULL)
+            {
+                const int h = _mm256_movemask_ps(hm);
+                for(unsigned int l = 0; l < SIM_LANES; l++)
+                    hit[(blk*SIM_LANES + l)*n + i] = (h >> l) & 1;
+            }
+        }
+    }
+}
+
+#endif
+
+void sim_step_batch(simbatch* b, unsigned char* hit)
+{
+#ifndef NOSSE
+    if(__builtin_cpu_supports("avx2"))
+    {
+        sim_step_batch_avx2(b, hit);
+        return;
+    }
+#endif
+    sim_step_batch_scalar(b, hit);
+}
+
+#endif
@@ -0,0 +1,330 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Self-describing dataset files.
+
+    Every shard written by ucc starts with a 128 byte dsheader that
+    says what the rows are (X states, a label set of inc/labels.h or
+    trajectory frames), how many floats a row has, the sphere count,
+    scale, speed, seed and collision model of the generator, how many
+    steps apart the rows of a universe are, the burn-in before the
+    first, how far ahead each set of labels of a Y row is and how
+    many rows follow.
+    After the rows comes a block index, one dsblock per buffer the
+    writer flushed, giving the file offset, row count and checksum of
+    each block so a reader can seek to any row, memory map the data
+    or check just the blocks it reads.
+
+    The checksum is a Fletcher style pair of 64 bit running sums over
+    the data as little endian uint32 words, a += w then b += a, which
+    runs at memory speed on the writer thread and is order sensitive.
+    Block sums combine into the file sum without another pass, see
+    dsSumJoin(). numpy reproduces it with a cumulative sum, dataset.py.
+
+    The header is written first with complete = 0 and rewritten when
+    the file is closed cleanly, so a file from a run that crashed is
+    still recognised and its whole rows can still be read.
+    dsResume() cuts a shard back to the rows a checkpoint covers,
+    finished or not, and sums them again so writing can carry on.
+
+    All fields are little endian.
+
+    Requires POSIX mmap
+*/
+
+#ifndef DSFILE_H
+#define DSFILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DS_MAGIC 0x53444355 // "UCDS"
+#define DS_VERSION 1
+#define DS_HORIZONS 6 // label sets a Y row can hold
+
+enum
+{
+    DS_X = 0,           // x,y,z,dx,dy,dz per sphere
+    DS_Y_POSITION = 1,  // x,y,z per sphere after the step, for each horizon
+    DS_Y_DIRECTION = 2, // dx,dy,dz per sphere that collided between the X row and the horizon, else zeros, for each horizon
+    DS_TRAJECTORY = 3,  // X rows, frames of universes rows stride steps apart
+    DS_Y_FLAG = 4,      // 1 per sphere that collided between the X row and the horizon, else 0, for each horizon
+    DS_Y_PARTNER = 5,   // id of the sphere it last collided with between the X row and the horizon, else -1, for each horizon (inc/labels.h)
+    DS_Y_SPARSE = 6     // a labelevent per sphere that collided, rows are events and samples are X rows (inc/labels.h)
+};
+
+enum
+{
+    DS_PHYSICS_ORDERED = 0, // sim_step(), every ordered pair in index order
+    DS_PHYSICS_PAIRS = 1,   // sim_step_pairs(), each pair once against a snapshot
+    DS_PHYSICS_EVENTS = 2   // evStep(), event driven, sampled once per step
+};
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_bytes;  // the rows start here
+    uint32_t content;       // DS_X ...
+    uint32_t spheres;
+    uint32_t row_floats;
+    uint32_t universes;     // rows per step
+    uint32_t shard;
+    uint64_t seed;
+    float scale;
+    float speed;
+    uint64_t rows;
+    uint64_t samples;       // training samples, rows less the final frame of a trajectory
+    uint64_t index_offset;  // byte offset of the block index
+    uint32_t blocks;
+    uint32_t complete;      // 1 once the file was closed cleanly
+    uint64_t sum_a, sum_b;  // checksum of all the rows
+    uint32_t physics;       // DS_PHYSICS_ORDERED ...
+    uint32_t stride;        // steps from a row to the next of its universe, 0 in files from before it was recorded means 1
+    uint16_t horizon[DS_HORIZONS]; // steps from the X row to each label set of a Y row in order, zeros after the last, all zero means one at the stride
+    uint32_t burnin;        // steps every universe took before its first row
+    uint8_t reserved[4];
+    uint32_t header_sum;    // low 32 bits of sum_b of the header before this field
+} dsheader;
+_Static_assert(sizeof(dsheader) == 128, "dsheader is 128 bytes");
+
+typedef struct
+{
+    uint64_t offset;        // byte offset in the file
+    uint64_t rows;
+    uint64_t sum_a, sum_b;
+} dsblock;
+
+// writing, the rows themselves go through an astream with dsOnWrite() as its onwrite function
+typedef struct
+{
+    dsheader h;
+    char file[64];
+    dsblock* index;
+    uint32_t cap;
+    uint64_t offset;        // where the next block starts
+    int err;
+} dsout;
+
+int  dsCreate(dsout* d, const char* file, const dsheader* h); // truncates the file and writes the header
+void dsOnWrite(void* user, const char* buf, const size_t bytes);
+int  dsFinish(dsout* d, const uint64_t samples); // after the astream is closed, appends the index and rewrites the header
+int  dsResume(dsout* d, const char* file, const uint64_t rows); // keeps the first rows of a shard to append to, -1 if it has fewer
+
+// reading
+typedef struct
+{
+    dsheader h;
+    const char* map;
+    size_t bytes;
+    const float* rows;      // h.rows rows of h.row_floats
+    const dsblock* index;   // NULL if the file is not complete
+} dsfile;
+
+int  dsOpen(dsfile* f, const char* file); // -1 if it is not a dataset file or the header is damaged
+void dsClose(dsfile* f);
+int  dsVerify(const dsfile* f); // checks every block, returns the number of bad blocks, those a damaged index can not locate included, or -1 if it can not tell
+
+void dsSum(const void* p, const size_t bytes, uint64_t* a, uint64_t* b);
+void dsSumJoin(uint64_t* a, uint64_t* b, const uint64_t words, const uint64_t na, const uint64_t nb); // append a block of words with sums na, nb
+
+//
+
+void dsSum(const void* p, const size_t bytes, uint64_t* a, uint64_t* b)
+{
+    const uint32_t* w = p;
+    uint64_t sa = 0, sb = 0;
+    for(size_t i = 0; i < bytes/4; i++)
+    {
+        sa += w[i];
+        sb += sa;
+    }
+    *a = sa, *b = sb;
+}
+
+void dsSumJoin(uint64_t* a, uint64_t* b, const uint64_t words, const uint64_t na, const uint64_t nb)
+{
+    *b += words * *a + nb;
+    *a += na;
+}
+
+static uint32_t dsHeaderSum(const dsheader* h)
+{
+    uint64_t a, b;
+    dsSum(h, offsetof(dsheader, header_sum), &a, &b);
+    return (uint32_t)b;
+}
+
+int dsCreate(dsout* d, const char* file, const dsheader* h)
+{
+    dsheader nh = *h;
+    nh.magic = DS_MAGIC;
+    nh.version = DS_VERSION;
+    nh.header_bytes = sizeof(dsheader);
+    nh.header_sum = dsHeaderSum(&nh);
+    memset(d, 0, sizeof(dsout));
+    d->h = nh;
+    d->offset = sizeof(dsheader);
+    snprintf(d->file, sizeof(d->file), "%s", file);
+
+    const int fd = open(file, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+    if(fd < 0){return -1;}
+    const ssize_t r = write(fd, &nh, sizeof(dsheader));
+    close(fd);
+    return r == sizeof(dsheader) ? 0 : -1;
+}
+
+void dsOnWrite(void* user, const char* buf, const size_t bytes)
+{
+    dsout* d = user;
+    if(d->h.blocks == d->cap)
+    {
+        const uint32_t cap = d->cap == 0 ? 64 : d->cap*2;
+        dsblock* index = realloc(d->index, cap*sizeof(dsblock));
+        if(index == NULL){d->err = 1; return;}
+        d->index = index;
+        d->cap = cap;
+    }
+    dsblock* k = &d->index[d->h.blocks++];
+    k->offset = d->offset;
+    k->rows = bytes / (d->h.row_floats*sizeof(float));
+    dsSum(buf, bytes, &k->sum_a, &k->sum_b);
+    dsSumJoin(&d->h.sum_a, &d->h.sum_b, bytes/4, k->sum_a, k->sum_b);
+    d->h.rows += k->rows;
+    d->offset += bytes;
+}
+
+int dsFinish(dsout* d, const uint64_t samples)
+{
+    if(d->err == 1){return -1;}
+    d->h.samples = samples;
+    d->h.index_offset = d->offset;
+    d->h.complete = 1;
+    d->h.header_sum = dsHeaderSum(&d->h);
+
+    const int fd = open(d->file, O_WRONLY);
+    if(fd < 0){return -1;}
+    const size_t ib = d->h.blocks*sizeof(dsblock);
+    int r = 0;
+    if(pwrite(fd, d->index, ib, d->offset) != (ssize_t)ib){r = -1;}
+    if(pwrite(fd, &d->h, sizeof(dsheader), 0) != sizeof(dsheader)){r = -1;}
+    close(fd);
+    free(d->index);
+    d->index = NULL;
+    return r;
+}
+
+int dsResume(dsout* d, const char* file, const uint64_t rows)
+{
+    dsfile f;
+    if(dsOpen(&f, file) < 0){return -1;}
+    if(f.h.rows < rows){dsClose(&f); return -1;}
+    memset(d, 0, sizeof(dsout));
+    d->h = f.h;
+    d->h.rows = d->h.samples = d->h.index_offset = d->h.sum_a = d->h.sum_b = 0;
+    d->h.blocks = d->h.complete = 0;
+    d->offset = d->h.header_bytes;
+    snprintf(d->file, sizeof(d->file), "%s", file);
+
+    // index the rows kept in 4MB blocks as the writer would have
+    const size_t row_bytes = d->h.row_floats*sizeof(float);
+    uint64_t block = 4194304 / row_bytes;
+    if(block == 0){block = 1;}
+    for(uint64_t r = 0; r < rows; r += block)
+    {
+        const uint64_t n = rows - r < block ? rows - r : block;
+        dsOnWrite(d, f.map + d->offset, n*row_bytes);
+    }
+    dsClose(&f);
+    if(d->err == 1){return -1;}
+
+    d->h.header_sum = dsHeaderSum(&d->h);
+    const int fd = open(file, O_WRONLY);
+    if(fd < 0){return -1;}
+    int r = 0;
+    if(ftruncate(fd, d->offset) < 0){r = -1;}
+    if(pwrite(fd, &d->h, sizeof(dsheader), 0) != sizeof(dsheader)){r = -1;}
+    close(fd);
+    return r;
+}
+
+int dsOpen(dsfile* f, const char* file)
+{
+    memset(f, 0, sizeof(dsfile));
+    const int fd = open(file, O_RDONLY);
+    if(fd < 0){return -1;}
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(dsheader)){close(fd); return -1;}
+    f->bytes = st.st_size;
+    void* p = mmap(NULL, f->bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED){return -1;}
+    f->map = p;
+
+    memcpy(&f->h, f->map, sizeof(dsheader));
+    dsheader* h = &f->h;
+    if(h->magic != DS_MAGIC || h->version != DS_VERSION || h->header_sum != dsHeaderSum(h) ||
+        h->row_floats == 0 || h->header_bytes > f->bytes){dsClose(f); return -1;}
+    f->rows = (const float*)(f->map + h->header_bytes);
+
+    const size_t row_bytes = h->row_floats*sizeof(float);
+    if(h->complete == 1)
+    {
+        // the index must end the file exactly
+        if(h->index_offset != h->header_bytes + h->rows*row_bytes ||
+            h->index_offset + h->blocks*sizeof(dsblock) != f->bytes){dsClose(f); return -1;}
+        f->index = (const dsblock*)(f->map + h->index_offset);
+    }
+    else
+    {
+        // unfinished, use every whole row
+        h->rows = (f->bytes - h->header_bytes) / row_bytes;
+        h->samples = h->content == DS_TRAJECTORY ? (h->rows > h->universes ? h->rows - h->universes : 0) : h->rows;
+    }
+    return 0;
+}
+
+void dsClose(dsfile* f)
+{
+    if(f->map != NULL){munmap((void*)f->map, f->bytes);}
+    f->map = NULL;
+    f->rows = NULL;
+    f->index = NULL;
+}
+
+int dsVerify(const dsfile* f)
+{
+    if(f->index == NULL){return -1;}
+    int bad = 0;
+    uint64_t a = 0, b = 0, off = f->h.header_bytes;
+    for(uint32_t i = 0; i < f->h.blocks; i++)
+    {
+        const dsblock* k = &f->index[i];
+        const size_t row_bytes = f->h.row_floats*sizeof(float);
+
+        // the index has no checksum of its own, a block that does not follow the last or runs past the rows can not be found and neither can any after it
+        if(k->offset != off || k->rows > (f->h.index_offset - off) / row_bytes)
+        {
+            bad += f->h.blocks - i;
+            break;
+        }
+        const size_t bytes = k->rows*row_bytes;
+        uint64_t na, nb;
+        dsSum(f->map + k->offset, bytes, &na, &nb);
+        if(na != k->sum_a || nb != k->sum_b){bad++;}
+        dsSumJoin(&a, &b, bytes/4, na, nb);
+        off += bytes;
+    }
+    if(bad == 0 && (a != f->h.sum_a || b != f->h.sum_b)){bad++;}
+    return bad;
+}
+
+#endif
@@ -0,0 +1,155 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Label writers.
+
+    The physics is the same for every model, only what the Y rows hold
+    differs, so ucc steps the universes once and hands the state at each
+    horizon to every label set asked for, each with its own shard. A
+    writer fills the floats of one universe from a labelview, the state
+    arrays as they lie in a sim or simbatch and the spheres that collided
+    since the X row.
+
+        positions   x,y,z per sphere (EntireSimulation)
+        directions  dx,dy,dz per sphere that collided, else zeros (CollisionsSimulation)
+        flags       1 per sphere that collided, else 0
+        partners    id of the sphere it last collided with, else -1
+        sparse      a labelevent per sphere that collided, its row,
+                    horizon and the directions label
+
+    The partner is recorded by the step kernels at the collision, see
+    partner in sim.h.
+
+    Collisions are rare so nearly every directions label is zeros, the
+    sparse set keeps only the spheres that collided as 32 byte records
+    in row order, about 1/50th of the dense rows at 16 spheres, and
+    dataset.py expands it again or reads just the rows with collisions
+    and a sample of those without.
+
+    Only positions can be rebuilt from a trajectory.
+
+    Requires dsfile.h
+*/
+
+#ifndef LABELS_H
+#define LABELS_H
+
+#include "dsfile.h"
+
+#define LABEL_SETS 5
+#define LABEL_EVENT_FLOATS 8 // words of a labelevent, the row_floats of a sparse shard
+
+typedef struct
+{
+    const float *x, *y, *z, *dx, *dy, *dz;
+    unsigned int n;
+    unsigned int stride;        // floats from one sphere to the next
+    const unsigned int* slot;   // array index of each sphere id, NULL if they are in id order
+    const unsigned char* hit;   // in sphere id order, 1 if it collided since the X row
+    const int* partner;         // in sphere id order, the id of the sphere it last collided with where hit is 1
+} labelview;
+
+typedef void (*label_fn)(float* r, const labelview* v);
+
+typedef struct
+{
+    const char* name;
+    unsigned int content;       // DS_Y_POSITION ...
+    unsigned int floats;        // per sphere
+    unsigned int trajectory;    // 1 if a trajectory holds it
+    label_fn write;             // n*floats floats in sphere id order
+    unsigned int sparse;        // 1 if the spheres written as nonzero go to the shard as labelevents instead
+} labelset;
+
+// a sparse label, one per sphere that collided
+typedef struct
+{
+    uint64_t row;               // of the X row in its shard
+    uint32_t sphere;            // id
+    uint32_t horizon;           // index in the horizons of the header
+    float dx, dy, dz;           // its direction at the horizon
+    uint32_t reserved;
+} labelevent;
+_Static_assert(sizeof(labelevent) == LABEL_EVENT_FLOATS*4, "labelevent is 8 words");
+
+const labelset* labelFind(const char* name); // NULL if there is no such label set
+
+// the events of one universe's row of directions, n spheres at each of nh horizons, returns how many
+unsigned int labelEvents(labelevent* e, const float* dense, const uint64_t row, const unsigned int n, const unsigned int nh);
+
+//
+
+static unsigned int labelAt(const labelview* v, const unsigned int i)
+{
+    return (v->slot != NULL ? v->slot[i] : i)*v->stride;
+}
+
+static void labelPositions(float* r, const labelview* v)
+{
+    for(unsigned int i = 0; i < v->n; i++)
+    {
+        const unsigned int o = labelAt(v, i);
+        *r++ = v->x[o];
+        *r++ = v->y[o];
+        *r++ = v->z[o];
+    }
+}
+
+static void labelDirections(float* r, const labelview* v)
+{
+    for(unsigned int i = 0; i < v->n; i++)
+    {
+        const unsigned int o = labelAt(v, i);
+        const int h = v->hit[i] == 1;
+        *r++ = h ? v->dx[o] : 0.f;
+        *r++ = h ? v->dy[o] : 0.f;
+        *r++ = h ? v->dz[o] : 0.f;
+    }
+}
+
+static void labelFlags(float* r, const labelview* v)
+{
+    for(unsigned int i = 0; i < v->n; i++)
+        r[i] = v->hit[i] == 1 ? 1.f : 0.f;
+}
+
+static void labelPartners(float* r, const labelview* v)
+{
+    for(unsigned int i = 0; i < v->n; i++)
+        r[i] = v->hit[i] == 1 ? (float)v->partner[i] : -1.f;
+}
+
+static const labelset label_sets[LABEL_SETS] =
+{
+    {"positions", DS_Y_POSITION, 3, 1, labelPositions, 0},
+    {"directions", DS_Y_DIRECTION, 3, 0, labelDirections, 0},
+    {"flags", DS_Y_FLAG, 1, 0, labelFlags, 0},
+    {"partners", DS_Y_PARTNER, 1, 0, labelPartners, 0},
+    {"sparse", DS_Y_SPARSE, 3, 0, labelDirections, 1}
+};
+
+const labelset* labelFind(const char* name)
+{
+    for(unsigned int i = 0; i < LABEL_SETS; i++)
+        if(strcmp(label_sets[i].name, name) == 0)
+            return &label_sets[i];
+    return NULL;
+}
+
+unsigned int labelEvents(labelevent* e, const float* dense, const uint64_t row, const unsigned int n, const unsigned int nh)
+{
+    unsigned int c = 0;
+    for(unsigned int h = 0; h < nh; h++)
+    {
+        for(unsigned int i = 0; i < n; i++, dense += 3)
+        {
+            if(dense[0] == 0.f && dense[1] == 0.f && dense[2] == 0.f){continue;}
+            e[c] = (labelevent){row, i, h, dense[0], dense[1], dense[2], 0};
+            c++;
+        }
+    }
+    return c;
+}
+
+#endif
@@ -0,0 +1,272 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Feed-forward network inference for the Keras Dense models.
+
+    export.py flattens a SavedModel from models/ into a .mlp file and
+    mlpRun() evaluates it in-process, so the viewer no longer has to
+    round trip every step through /dev/shm and a TensorFlow process.
+
+    File format, all little endian:
+
+        uint32 magic "UCML", uint32 version, uint32 layers, uint32 inputs
+        then per layer;
+            uint32 inputs, uint32 outputs, uint32 activation (MLP_*)
+            float kernel[inputs][outputs] (the Keras kernel as is)
+            float bias[outputs]
+
+    Each layer is stored with its outputs padded to SIM_LANES so the
+    AVX2 kernel can accumulate 32 outputs at a time in registers while
+    streaming the kernel rows once per input.
+
+    Requires sim.h (for SIM_LANES)
+*/
+
+#ifndef MLP_H
+#define MLP_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MLP_MAGIC 0x4C4D4355 // "UCML"
+#define MLP_VERSION 1
+
+enum
+{
+    MLP_LINEAR = 0,
+    MLP_RELU = 1,
+    MLP_ELU = 2,
+    MLP_SELU = 3,
+    MLP_TANH = 4,
+    MLP_SIGMOID = 5,
+    MLP_SOFTPLUS = 6,
+    MLP_SOFTSIGN = 7,
+    MLP_SWISH = 8
+};
+
+typedef struct
+{
+    unsigned int in, out;
+    unsigned int op;       // out padded to SIM_LANES
+    unsigned int act;
+    float* w;              // [in][op]
+    float* b;              // [op]
+} mlplayer;
+
+typedef struct
+{
+    unsigned int layers;
+    unsigned int in, out;
+    mlplayer* l;
+    float *t0, *t1;        // activations, as wide as the widest layer
+} mlp;
+
+int  mlpLoad(mlp* m, const char* file); // -1 if the file can not be read or is not a .mlp
+void mlpFree(mlp* m);
+void mlpRun(mlp* m, const float* in, float* out); // in has m->in floats and out gets m->out
+
+//
+
+int mlpLoad(mlp* m, const char* file)
+{
+    memset(m, 0, sizeof(mlp));
+    FILE* f = fopen(file, "rb");
+    if(f == NULL){return -1;}
+
+    uint32_t h[4];
+    if(fread(h, sizeof(uint32_t), 4, f) != 4 || h[0] != MLP_MAGIC || h[1] != MLP_VERSION || h[2] == 0){fclose(f); return -1;}
+    m->layers = h[2];
+    m->in = h[3];
+    m->l = calloc(m->layers, sizeof(mlplayer));
+    if(m->l == NULL){fclose(f); return -1;}
+
+    unsigned int widest = (m->in + SIM_LANES-1) & ~(SIM_LANES-1);
+    unsigned int prev = m->in;
+    for(unsigned int i = 0; i < m->layers; i++)
+    {
+        mlplayer* l = &m->l[i];
+        uint32_t d[3];
+        if(fread(d, sizeof(uint32_t), 3, f) != 3 || d[0] != prev || d[1] == 0 || d[2] > MLP_SWISH){fclose(f); mlpFree(m); return -1;}
+        l->in = d[0];
+        l->out = d[1];
+        l->act = d[2];
+        l->op = (l->out + SIM_LANES-1) & ~(SIM_LANES-1);
+        l->w = aligned_alloc(32, (size_t)l->in * l->op * sizeof(float));
+        l->b = aligned_alloc(32, l->op * sizeof(float));
+        if(l->w == NULL || l->b == NULL){fclose(f); mlpFree(m); return -1;}
+        memset(l->w, 0, (size_t)l->in * l->op * sizeof(float));
+        memset(l->b, 0, l->op * sizeof(float));
+        for(unsigned int r = 0; r < l->in; r++)
+            if(fread(&l->w[(size_t)r * l->op], sizeof(float), l->out, f) != l->out){fclose(f); mlpFree(m); return -1;}
+        if(fread(l->b, sizeof(float), l->out, f) != l->out){fclose(f); mlpFree(m); return -1;}
+        if(l->op > widest){widest = l->op;}
+        prev = l->out;
+    }
+    fclose(f);
+    m->out = prev;
+
+    m->t0 = aligned_alloc(32, widest * sizeof(float));
+    m->t1 = aligned_alloc(32, widest * sizeof(float));
+    if(m->t0 == NULL || m->t1 == NULL){mlpFree(m); return -1;}
+    return 0;
+}
+
+void mlpFree(mlp* m)
+{
+    for(unsigned int i = 0; m->l != NULL && i < m->layers; i++)
+    {
+        free(m->l[i].w);
+        free(m->l[i].b);
+    }
+    free(m->l);
+    free(m->t0);
+    free(m->t1);
+    memset(m, 0, sizeof(mlp));
+}
+
+static void mlpActivate(const unsigned int act, float* y, const unsigned int n)
+{
+    switch(act)
+    {
+        case MLP_RELU:     for(unsigned int i = 0; i < n; i++){y[i] = y[i] > 0.f ? y[i] : 0.f;} break;
+        case MLP_ELU:      for(unsigned int i = 0; i < n; i++){y[i] = y[i] > 0.f ? y[i] : expf(y[i]) - 1.f;} break;
+        case MLP_SELU:     for(unsigned int i = 0; i < n; i++){y[i] = 1.0507009873554805f * (y[i] > 0.f ? y[i] : 1.6732632423543772f * (expf(y[i]) - 1.f));} break;
+        case MLP_TANH:     for(unsigned int i = 0; i < n; i++){y[i] = tanhf(y[i]);} break;
+        case MLP_SIGMOID:  for(unsigned int i = 0; i < n; i++){y[i] = 1.f / (1.f + expf(-y[i]));} break;
+        case MLP_SOFTPLUS: for(unsigned int i = 0; i < n; i++){y[i] = log1pf(expf(y[i]));} break;
+        case MLP_SOFTSIGN: for(unsigned int i = 0; i < n; i++){y[i] = y[i] / (1.f + fabsf(y[i]));} break;
+        case MLP_SWISH:    for(unsigned int i = 0; i < n; i++){y[i] = y[i] / (1.f + expf(-y[i]));} break;
+    }
+}
+
+static void mlpLayerScalar(const mlplayer* l, const float* x, float* y)
+{
+    memcpy(y, l->b, l->op * sizeof(float));
+    for(unsigned int i = 0; i < l->in; i++)
+    {
+        const float xi = x[i];
+        const float* w = &l->w[(size_t)i * l->op];
+        for(unsigned int o = 0; o < l->out; o++)
+            y[o] += xi * w[o];
+    }
+}
+
+#ifndef NOSSE
+
+// expf() across lanes, Cephes polynomial, within a few ulp for the range a float can hold
+__attribute__((target("avx2,fma"), always_inline))
+static inline __m256 mlpExp8(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3f)), _mm256_set1_ps(88.3f));
+    const __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), x);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.f)));
+    const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+// the activations built on expf() 8 at a time, the rest are cheap enough as they are
+__attribute__((target("avx2,fma")))
+static int mlpActivateAVX2(const unsigned int act, float* y, const unsigned int n)
+{
+    const __m256 one = _mm256_set1_ps(1.f), zero = _mm256_setzero_ps();
+    if(act != MLP_ELU && act != MLP_SELU && act != MLP_TANH && act != MLP_SIGMOID && act != MLP_SWISH){return 0;}
+    for(unsigned int i = 0; i < n; i += 8) // y is padded to SIM_LANES
+    {
+        const __m256 x = _mm256_load_ps(&y[i]);
+        __m256 r;
+        if(act == MLP_TANH) // 1 - 2 / (e^2x + 1)
+            r = _mm256_sub_ps(one, _mm256_div_ps(_mm256_set1_ps(2.f), _mm256_add_ps(mlpExp8(_mm256_add_ps(x, x)), one)));
+        else if(act == MLP_SIGMOID)
+            r = _mm256_div_ps(one, _mm256_add_ps(one, mlpExp8(_mm256_sub_ps(zero, x))));
+        else if(act == MLP_SWISH)
+            r = _mm256_div_ps(x, _mm256_add_ps(one, mlpExp8(_mm256_sub_ps(zero, x))));
+        else
+        {
+            const __m256 neg = _mm256_sub_ps(mlpExp8(_mm256_min_ps(x, zero)), one);
+            if(act == MLP_SELU)
+                r = _mm256_mul_ps(_mm256_set1_ps(1.0507009873554805f), _mm256_blendv_ps(_mm256_mul_ps(_mm256_set1_ps(1.6732632423543772f), neg), x, _mm256_cmp_ps(x, zero, _CMP_GT_OQ)));
+            else
+                r = _mm256_blendv_ps(neg, x, _mm256_cmp_ps(x, zero, _CMP_GT_OQ));
+        }
+        _mm256_store_ps(&y[i], r);
+    }
+    return 1;
+}
+
+__attribute__((target("avx2,fma")))
+static void mlpLayerAVX2(const mlplayer* l, const float* x, float* y)
+{
+    unsigned int o = 0;
+
+    // 32 outputs at a time, the accumulators stay in registers for the whole kernel column
+    for(; o + 32 <= l->op; o += 32)
+    {
+        __m256 a0 = _mm256_load_ps(&l->b[o]),    a1 = _mm256_load_ps(&l->b[o+8]);
+        __m256 a2 = _mm256_load_ps(&l->b[o+16]), a3 = _mm256_load_ps(&l->b[o+24]);
+        const float* w = &l->w[o];
+        for(unsigned int i = 0; i < l->in; i++, w += l->op)
+        {
+            const __m256 xi = _mm256_set1_ps(x[i]);
+            a0 = _mm256_fmadd_ps(xi, _mm256_load_ps(w),    a0);
+            a1 = _mm256_fmadd_ps(xi, _mm256_load_ps(w+8),  a1);
+            a2 = _mm256_fmadd_ps(xi, _mm256_load_ps(w+16), a2);
+            a3 = _mm256_fmadd_ps(xi, _mm256_load_ps(w+24), a3);
+        }
+        _mm256_store_ps(&y[o], a0),    _mm256_store_ps(&y[o+8], a1);
+        _mm256_store_ps(&y[o+16], a2), _mm256_store_ps(&y[o+24], a3);
+    }
+
+    // remaining outputs 8 at a time
+    for(; o < l->op; o += 8)
+    {
+        __m256 a = _mm256_load_ps(&l->b[o]);
+        const float* w = &l->w[o];
+        for(unsigned int i = 0; i < l->in; i++, w += l->op)
+            a = _mm256_fmadd_ps(_mm256_set1_ps(x[i]), _mm256_load_ps(w), a);
+        _mm256_store_ps(&y[o], a);
+    }
+}
+
+#endif
+
+void mlpRun(mlp* m, const float* in, float* out)
+{
+#ifndef NOSSE
+    const int avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    const float* x = in;
+    float* y = m->t0;
+    for(unsigned int i = 0; i < m->layers; i++)
+    {
+        const mlplayer* l = &m->l[i];
+#ifndef NOSSE
+        if(avx2)
+        {
+            mlpLayerAVX2(l, x, y);
+            if(mlpActivateAVX2(l->act, y, l->out) == 0){mlpActivate(l->act, y, l->out);}
+        }
+        else
+#endif
+        {
+            mlpLayerScalar(l, x, y);
+            mlpActivate(l->act, y, l->out);
+        }
+        x = y;
+        y = y == m->t0 ? m->t1 : m->t0;
+    }
+    memcpy(out, x, m->out * sizeof(float));
+}
+
+#endif
@@ -0,0 +1,384 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Counter based random numbers, Philox4x32-10.
+    https://www.thesalmons.org/john/random123/papers/random123sc11.pdf
+
+    Every block of four 32 bit words is a pure function of the
+    64 bit seed (the key), a 64 bit stream number and the 64 bit
+    block number, there is no state shared between streams. So
+    any number of streams can be drawn from at once on any number
+    of threads, the same seed and stream always give the same
+    numbers, and blocks can be computed 8 at a time in AVX2 lanes.
+
+    pxFill() and pxFillc() fill arrays of floats 32 at a time with
+    AVX2 and otherwise one block at a time, both produce the same
+    words in the same order so the result does not depend on the
+    machine.
+
+    pxRuv() and pxBall() fill arrays of unit vectors and of points
+    inside the unit sphere 8 at a time with no rejection and no
+    libm. z is uniform on [-1, 1] which by Archimedes' hat-box
+    theorem makes the point uniform on the sphere, so no acos is
+    needed, and the angle around z is uniform on [0, PI/4] and then
+    reflected into one of the 8 octants of the circle by 3 bits of
+    the same word, so sin and cos are only needed on [0, PI/4]
+    where the Cephes minimax polynomials are within 7.5e-8 of the
+    true values. The vectors are of unit length to within 1.4e-7.
+    The radius of a point in the ball is the largest of three
+    uniform numbers which is distributed as r^3, exactly what
+    uniform in the ball needs, so there is no cube root either.
+    The scalar path does the same operations in the same order and
+    neither uses FMA so both give the same vectors, this needs
+    -ffp-contract=off as ucc is built or no FMA in the target.
+
+    A stream is never shared between threads, give every thread,
+    universe or shard its own stream number instead.
+*/
+
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef NOSSE
+    #include <x86intrin.h>
+#endif
+
+#define PX_M0 0xD2511F53u
+#define PX_M1 0xCD9E8D57u
+#define PX_W0 0x9E3779B9u
+#define PX_W1 0xBB67AE85u
+#define PX_ROUNDS 10
+#define PX_CHUNK 64 // vectors made at a time by pxBall() and pxRuv()
+#define PX_ANGLE 3.7450702e-7f // PI/4 / 2^21
+#define PX_S1 -1.6666654611e-1f
+#define PX_S2 8.3321608736e-3f
+#define PX_S3 -1.9515295891e-4f
+#define PX_C1 4.166664568298827e-2f
+#define PX_C2 -1.388731625493765e-3f
+#define PX_C3 2.443315711809948e-5f
+
+enum {PX_UNIT, PX_SIGNED, PX_WORDS};
+
+typedef struct
+{
+    uint32_t key[2];    // the seed
+    uint32_t stream[2];
+    uint64_t block;     // next block to generate
+    uint32_t buf[4];    // the rest of the last block
+    unsigned int left;  // words left in buf
+} philox;
+
+void pxSeed(philox* p, const uint64_t seed, const uint64_t stream);
+void pxBlock(const philox* p, const uint64_t block, uint32_t r[4]); // the four words of any block
+uint32_t pxNext(philox* p);
+uint32_t pxBelow(philox* p, const uint32_t n); // uniform in [0, n) with no modulo bias, n > 0
+
+float pxRandf(philox* p);  // [0, 1)
+float pxRandfc(philox* p); // [-1, 1)
+void pxFill(philox* p, float* r, const size_t n);  // n of [0, 1)
+void pxFillc(philox* p, float* r, const size_t n); // n of [-1, 1)
+void pxWords(philox* p, uint32_t* r, const size_t n); // n raw words
+
+void pxBall(philox* p, float* x, float* y, float* z, const size_t n); // n points inside the unit sphere
+void pxRuv(philox* p, float* x, float* y, float* z, const size_t n);  // n unit vectors
+
+//
+
+void pxSeed(philox* p, const uint64_t seed, const uint64_t stream)
+{
+    memset(p, 0, sizeof(philox));
+    p->key[0] = (uint32_t)seed;
+    p->key[1] = (uint32_t)(seed >> 32);
+    p->stream[0] = (uint32_t)stream;
+    p->stream[1] = (uint32_t)(stream >> 32);
+}
+
+void pxBlock(const philox* p, const uint64_t block, uint32_t r[4])
+{
+    uint32_t c0 = (uint32_t)block, c1 = (uint32_t)(block >> 32), c2 = p->stream[0], c3 = p->stream[1];
+    uint32_t k0 = p->key[0], k1 = p->key[1];
+    for(int i = 0; i < PX_ROUNDS; i++)
+    {
+        const uint64_t a = (uint64_t)PX_M0 * c0;
+        const uint64_t b = (uint64_t)PX_M1 * c2;
+        const uint32_t n0 = (uint32_t)(b >> 32) ^ c1 ^ k0;
+        const uint32_t n2 = (uint32_t)(a >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)b;
+        c3 = (uint32_t)a;
+        c0 = n0;
+        c2 = n2;
+        k0 += PX_W0;
+        k1 += PX_W1;
+    }
+    r[0] = c0, r[1] = c1, r[2] = c2, r[3] = c3;
+}
+
+uint32_t pxNext(philox* p)
+{
+    if(p->left == 0)
+    {
+        pxBlock(p, p->block++, p->buf);
+        p->left = 4;
+    }
+    return p->buf[4 - p->left--];
+}
+
+// Lemire's multiply and shift, the low word decides the rare draws to reject
+uint32_t pxBelow(philox* p, const uint32_t n)
+{
+    uint64_t m = (uint64_t)pxNext(p) * n;
+    if((uint32_t)m < n)
+    {
+        const uint32_t t = -n % n;
+        while((uint32_t)m < t){m = (uint64_t)pxNext(p) * n;}
+    }
+    return m >> 32;
+}
+
+static inline float pxToF(const uint32_t u)
+{
+    return (float)(u >> 8) * 0x1p-24f;
+}
+
+static inline float pxToFc(const uint32_t u)
+{
+    return (float)((int32_t)u >> 8) * 0x1p-23f;
+}
+
+float pxRandf(philox* p)
+{
+    return pxToF(pxNext(p));
+}
+
+float pxRandfc(philox* p)
+{
+    return pxToFc(pxNext(p));
+}
+
+#ifndef NOSSE
+
+// the high and low halves of 8 32x32 bit products
+__attribute__((target("avx2"), always_inline))
+static inline void pxMulHiLo(const __m256i a, const __m256i m, __m256i* hi, __m256i* lo)
+{
+    const __m256i even = _mm256_mul_epu32(a, m);
+    const __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+    *lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    *hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+// 8 blocks from p->block on, as 32 words in block order
+__attribute__((target("avx2")))
+static void pxBlock8(philox* p, __m256i r[4])
+{
+    const __m256i m0 = _mm256_set1_epi32(PX_M0), m1 = _mm256_set1_epi32(PX_M1);
+    const uint64_t b = p->block;
+    __m256i c0 = _mm256_add_epi32(_mm256_set1_epi32((uint32_t)b), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i c1 = _mm256_set1_epi32((uint32_t)(b >> 32));
+    if((uint32_t)b > 0xFFFFFFF8u) // the low word wraps inside these 8
+        c1 = _mm256_sub_epi32(c1, _mm256_cmpgt_epi32(_mm256_xor_si256(_mm256_set1_epi32((uint32_t)b), _mm256_set1_epi32(0x80000000)), _mm256_xor_si256(c0, _mm256_set1_epi32(0x80000000))));
+    __m256i c2 = _mm256_set1_epi32(p->stream[0]), c3 = _mm256_set1_epi32(p->stream[1]);
+    uint32_t k0 = p->key[0], k1 = p->key[1];
+    for(int i = 0; i < PX_ROUNDS; i++)
+    {
+        __m256i ha, la, hb, lb;
+        pxMulHiLo(c0, m0, &ha, &la);
+        pxMulHiLo(c2, m1, &hb, &lb);
+        c0 = _mm256_xor_si256(_mm256_xor_si256(hb, c1), _mm256_set1_epi32(k0));
+        c2 = _mm256_xor_si256(_mm256_xor_si256(ha, c3), _mm256_set1_epi32(k1));
+        c1 = lb;
+        c3 = la;
+        k0 += PX_W0;
+        k1 += PX_W1;
+    }
+    p->block += 8;
+
+    // lane j of cw holds word w of block j, transpose to blocks 0-1, 2-3, 4-5, 6-7
+    const __m256i t0 = _mm256_unpacklo_epi32(c0, c1), t1 = _mm256_unpackhi_epi32(c0, c1);
+    const __m256i t2 = _mm256_unpacklo_epi32(c2, c3), t3 = _mm256_unpackhi_epi32(c2, c3);
+    const __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+    const __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+    r[0] = _mm256_permute2x128_si256(u0, u1, 0x20);
+    r[1] = _mm256_permute2x128_si256(u2, u3, 0x20);
+    r[2] = _mm256_permute2x128_si256(u0, u1, 0x31);
+    r[3] = _mm256_permute2x128_si256(u2, u3, 0x31);
+}
+
+// c is PX_UNIT, PX_SIGNED or PX_WORDS
+__attribute__((target("avx2")))
+static size_t pxFillAvx2(philox* p, void* r, const size_t n, const int c)
+{
+    const __m256 s = _mm256_set1_ps(c == PX_SIGNED ? 0x1p-23f : 0x1p-24f);
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32)
+    {
+        __m256i w[4];
+        pxBlock8(p, w);
+        for(int j = 0; j < 4; j++)
+        {
+            if(c == PX_WORDS){_mm256_storeu_si256((__m256i*)((uint32_t*)r + i + j*8), w[j]); continue;}
+            const __m256i v = c == PX_SIGNED ? _mm256_srai_epi32(w[j], 8) : _mm256_srli_epi32(w[j], 8);
+            _mm256_storeu_ps((float*)r + i + j*8, _mm256_mul_ps(_mm256_cvtepi32_ps(v), s));
+        }
+    }
+    return i;
+}
+
+#endif
+
+static inline void pxPut(philox* p, void* r, const size_t i, const int c)
+{
+    const uint32_t u = pxNext(p);
+    if(c == PX_WORDS){((uint32_t*)r)[i] = u;}
+    else{((float*)r)[i] = c == PX_SIGNED ? pxToFc(u) : pxToF(u);}
+}
+
+static void pxFillAny(philox* p, void* r, const size_t n, const int c)
+{
+    size_t i = 0;
+    for(; i < n && p->left > 0; i++){pxPut(p, r, i, c);}
+#ifndef NOSSE
+    if(__builtin_cpu_supports("avx2"))
+        i += pxFillAvx2(p, c == PX_WORDS ? (void*)((uint32_t*)r + i) : (void*)((float*)r + i), n - i, c);
+#endif
+    for(; i < n; i++){pxPut(p, r, i, c);}
+}
+
+void pxFill(philox* p, float* r, const size_t n)
+{
+    pxFillAny(p, r, n, PX_UNIT);
+}
+
+void pxFillc(philox* p, float* r, const size_t n)
+{
+    pxFillAny(p, r, n, PX_SIGNED);
+}
+
+void pxWords(philox* p, uint32_t* r, const size_t n)
+{
+    pxFillAny(p, r, n, PX_WORDS);
+}
+
+// minimax sin and cos for 0 <= a <= PI/4 from Cephes sinf.c and cosf.c, the AVX2 version below must do the same operations in the same order
+static inline float pxSin(const float a)
+{
+    const float a2 = a*a;
+    return a + a*a2*(PX_S1 + a2*(PX_S2 + a2*PX_S3));
+}
+
+static inline float pxCos(const float a)
+{
+    const float a2 = a*a;
+    return 1.f - 0.5f*a2 + a2*a2*(PX_C1 + a2*(PX_C2 + a2*PX_C3));
+}
+
+// unit vector from two words, scaled by r
+static inline void pxDir(const uint32_t wz, const uint32_t wa, const float r, float* x, float* y, float* z)
+{
+    const float h = pxToFc(wz);
+    const float a = (float)(wa >> 11) * PX_ANGLE;
+    const float l = sqrtf(1.f - h*h) * r;
+    const float s = pxSin(a) * l, c = pxCos(a) * l;
+    float dx = wa & 1 ? s : c, dy = wa & 1 ? c : s;
+    if(wa & 2){dx = -dx;}
+    if(wa & 4){dy = -dy;}
+    *x = dx, *y = dy, *z = h * r;
+}
+
+static inline float pxMax3(const uint32_t a, const uint32_t b, const uint32_t c)
+{
+    const float fa = pxToF(a), fb = pxToF(b), fc = pxToF(c);
+    const float m = fa > fb ? fa : fb;
+    return m > fc ? m : fc;
+}
+
+#ifndef NOSSE
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256 pxToF8(const __m256i w)
+{
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(w, 8)), _mm256_set1_ps(0x1p-24f));
+}
+
+// 8 of pxDir() at once, returns how many it did
+__attribute__((target("avx2")))
+static size_t pxDirAvx2(const uint32_t* w, const size_t n, const int ball, float* x, float* y, float* z)
+{
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        const __m256i wz = _mm256_loadu_si256((const __m256i*)(w + i));
+        const __m256i wa = _mm256_loadu_si256((const __m256i*)(w + n + i));
+        __m256 r = _mm256_set1_ps(1.f);
+        if(ball == 1)
+        {
+            const __m256 u0 = pxToF8(_mm256_loadu_si256((const __m256i*)(w + n*2 + i)));
+            const __m256 u1 = pxToF8(_mm256_loadu_si256((const __m256i*)(w + n*3 + i)));
+            const __m256 u2 = pxToF8(_mm256_loadu_si256((const __m256i*)(w + n*4 + i)));
+            r = _mm256_max_ps(_mm256_max_ps(u0, u1), u2);
+        }
+        const __m256 h = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(wz, 8)), _mm256_set1_ps(0x1p-23f));
+        const __m256 a = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(wa, 11)), _mm256_set1_ps(PX_ANGLE));
+        const __m256 l = _mm256_mul_ps(_mm256_sqrt_ps(_mm256_sub_ps(_mm256_set1_ps(1.f), _mm256_mul_ps(h, h))), r);
+        const __m256 a2 = _mm256_mul_ps(a, a);
+        __m256 ps = _mm256_add_ps(_mm256_set1_ps(PX_S2), _mm256_mul_ps(a2, _mm256_set1_ps(PX_S3)));
+        ps = _mm256_add_ps(_mm256_set1_ps(PX_S1), _mm256_mul_ps(a2, ps));
+        ps = _mm256_add_ps(a, _mm256_mul_ps(_mm256_mul_ps(a, a2), ps));
+        __m256 pc = _mm256_add_ps(_mm256_set1_ps(PX_C2), _mm256_mul_ps(a2, _mm256_set1_ps(PX_C3)));
+        pc = _mm256_add_ps(_mm256_set1_ps(PX_C1), _mm256_mul_ps(a2, pc));
+        pc = _mm256_add_ps(_mm256_sub_ps(_mm256_set1_ps(1.f), _mm256_mul_ps(_mm256_set1_ps(0.5f), a2)), _mm256_mul_ps(_mm256_mul_ps(a2, a2), pc));
+        const __m256 s = _mm256_mul_ps(ps, l), c = _mm256_mul_ps(pc, l);
+
+        // bit 0 swaps, bits 1 and 2 flip the signs
+        const __m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(wa, one), one));
+        const __m256 fx = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_srli_epi32(wa, 1), 31));
+        const __m256 fy = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_srli_epi32(wa, 2), 31));
+        _mm256_storeu_ps(x + i, _mm256_xor_ps(_mm256_blendv_ps(c, s, swap), _mm256_and_ps(fx, sign)));
+        _mm256_storeu_ps(y + i, _mm256_xor_ps(_mm256_blendv_ps(s, c, swap), _mm256_and_ps(fy, sign)));
+        _mm256_storeu_ps(z + i, _mm256_mul_ps(h, r));
+    }
+    return i;
+}
+
+#endif
+
+// a chunk at a time, the words of a chunk are z, angle and for the ball the three radii
+static void pxDirs(philox* p, float* x, float* y, float* z, const size_t n, const int ball)
+{
+    uint32_t w[PX_CHUNK*5];
+    for(size_t i = 0; i < n; i += PX_CHUNK)
+    {
+        const size_t m = n - i < PX_CHUNK ? n - i : PX_CHUNK;
+        pxWords(p, w, m * (ball == 1 ? 5 : 2));
+        size_t j = 0;
+#ifndef NOSSE
+        if(__builtin_cpu_supports("avx2"))
+            j = pxDirAvx2(w, m, ball, x + i, y + i, z + i);
+#endif
+        for(; j < m; j++)
+        {
+            const float r = ball == 1 ? pxMax3(w[m*2 + j], w[m*3 + j], w[m*4 + j]) : 1.f;
+            pxDir(w[j], w[m + j], r, x + i + j, y + i + j, z + i + j);
+        }
+    }
+}
+
+void pxBall(philox* p, float* x, float* y, float* z, const size_t n)
+{
+    pxDirs(p, x, y, z, n, 1);
+}
+
+void pxRuv(philox* p, float* x, float* y, float* z, const size_t n)
+{
+    pxDirs(p, x, y, z, n, 0);
+}
+
+#endif
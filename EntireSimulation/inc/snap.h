@@ -0,0 +1,275 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Simulation snapshots.
+
+    A snapshot file is a 128 byte snapheader followed by count
+    records of the same size, each a 64 byte snaprec with the step
+    counter and random stream of a universe then its state as six
+    arrays of n floats, x y z dx dy dz in sphere id order. Records
+    are whole states of one universe so a file can hold one universe
+    of a viewer, every universe of a ucc shard as a checkpoint, or
+    thousands of interesting starting states, and as the records are
+    fixed size and the file is mapped rather than read, record i is
+    a pointer and starting a batch of universes from any of them
+    costs no more than copying their floats.
+
+    snapCreate() writes to file.tmp and snapFinish() renames it over
+    the file, so a checkpoint is either the old one or the new one
+    and never half written. snapAppend() adds one record to a file
+    in place and makes it if it does not exist.
+
+    The header is summed like a dsheader, all fields are little
+    endian.
+
+    Requires sim.h, dsfile.h
+*/
+
+#ifndef SNAP_H
+#define SNAP_H
+
+#include "sim.h"
+#include "dsfile.h"
+
+#define SNAP_MAGIC 0x53534355 // "UCSS"
+#define SNAP_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_bytes;  // the records start here
+    uint32_t record_bytes;  // sizeof(snaprec) + spheres*6 floats
+    uint32_t spheres;
+    uint32_t physics;       // DS_PHYSICS_ORDERED ...
+    float scale;
+    float speed;
+    uint64_t count;         // records
+    uint64_t seed;          // of the run, 0 if none
+    uint64_t rows;          // dataset rows on disk when a ucc checkpoint was taken
+    uint32_t shard;
+    uint32_t stride;        // steps between the dataset rows of a universe, 0 = 1
+    uint16_t horizon[DS_HORIZONS]; // of the Y rows, as in a dsheader
+    uint8_t align[4];       // events is 8 byte aligned
+    uint64_t events;        // rows of the sparse label shard on disk when a ucc checkpoint was taken
+    uint8_t reserved[36];
+    uint32_t header_sum;    // low 32 bits of sum_b of the header before this field
+} snapheader;
+_Static_assert(sizeof(snapheader) == 128, "snapheader is 128 bytes");
+
+typedef struct
+{
+    uint64_t step;          // steps the universe has taken
+    uint64_t key;           // its philox stream, as a philox struct
+    uint64_t stream;
+    uint64_t block;
+    uint32_t buf[4];
+    uint32_t left;
+    uint8_t reserved[12];
+} snaprec;
+_Static_assert(sizeof(snaprec) == 64, "snaprec is 64 bytes");
+
+// writing
+typedef struct
+{
+    snapheader h;
+    char file[256];
+    int fd;
+    int err;
+} snapout;
+
+int snapCreate(snapout* o, const char* file, const snapheader* h); // h gives spheres to shard, the rest is filled in
+int snapAdd(snapout* o, const sim* s, const uint64_t step, const philox* rng); // rng may be NULL
+int snapFinish(snapout* o); // rewrites the header and renames file.tmp over file
+int snapAppend(const char* file, const snapheader* h, const sim* s, const uint64_t step, const philox* rng); // -1 if the file is for another sphere count
+
+// reading
+typedef struct
+{
+    snapheader h;
+    const char* map;
+    size_t bytes;
+} snapfile;
+
+int  snapOpen(snapfile* f, const char* file); // -1 if it is not a snapshot or the header is damaged
+void snapClose(snapfile* f);
+const snaprec* snapRecord(const snapfile* f, const uint64_t i);
+const float* snapState(const snapfile* f, const uint64_t i); // x y z dx dy dz arrays of h.spheres floats
+int  snapGet(const snapfile* f, const uint64_t i, sim* s, uint64_t* step, philox* rng); // s must have the same sphere count, step and rng may be NULL
+
+//
+
+static uint32_t snapHeaderSum(const snapheader* h)
+{
+    uint64_t a, b;
+    dsSum(h, offsetof(snapheader, header_sum), &a, &b);
+    return (uint32_t)b;
+}
+
+static void snapFill(snapheader* h)
+{
+    h->magic = SNAP_MAGIC;
+    h->version = SNAP_VERSION;
+    h->header_bytes = sizeof(snapheader);
+    h->record_bytes = sizeof(snaprec) + h->spheres*6*sizeof(float);
+    h->header_sum = snapHeaderSum(h);
+}
+
+int snapCreate(snapout* o, const char* file, const snapheader* h)
+{
+    memset(o, 0, sizeof(snapout));
+    o->h = *h;
+    o->h.count = 0;
+    snapFill(&o->h);
+    snprintf(o->file, sizeof(o->file), "%s", file);
+
+    char tmp[264];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    o->fd = open(tmp, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+    if(o->fd < 0){return -1;}
+    if(write(o->fd, &o->h, sizeof(snapheader)) != sizeof(snapheader)){o->err = 1;}
+    return o->err == 1 ? -1 : 0;
+}
+
+// the record of sphere ids 0 to n-1 whatever order the arrays are in
+static void snapPack(char* r, const sim* s, const uint64_t step, const philox* rng)
+{
+    snaprec* k = (snaprec*)r;
+    memset(k, 0, sizeof(snaprec));
+    k->step = step;
+    if(rng != NULL)
+    {
+        k->key = rng->key[0] | (uint64_t)rng->key[1] << 32;
+        k->stream = rng->stream[0] | (uint64_t)rng->stream[1] << 32;
+        k->block = rng->block;
+        memcpy(k->buf, rng->buf, sizeof(k->buf));
+        k->left = rng->left;
+    }
+    float* f = (float*)(r + sizeof(snaprec));
+    const float* a[6] = {s->x, s->y, s->z, s->dx, s->dy, s->dz};
+    for(int c = 0; c < 6; c++)
+        for(unsigned int i = 0; i < s->n; i++)
+            f[c*s->n + i] = a[c][simSlot(s, i)];
+}
+
+int snapAdd(snapout* o, const sim* s, const uint64_t step, const philox* rng)
+{
+    if(o->err == 1 || s->n != o->h.spheres){return -1;}
+    char* r = malloc(o->h.record_bytes);
+    if(r == NULL){o->err = 1; return -1;}
+    snapPack(r, s, step, rng);
+    if(write(o->fd, r, o->h.record_bytes) != (ssize_t)o->h.record_bytes){o->err = 1;}
+    free(r);
+    if(o->err == 1){return -1;}
+    o->h.count++;
+    return 0;
+}
+
+int snapFinish(snapout* o)
+{
+    o->h.header_sum = snapHeaderSum(&o->h);
+    if(o->err == 0 && pwrite(o->fd, &o->h, sizeof(snapheader), 0) != sizeof(snapheader)){o->err = 1;}
+    close(o->fd);
+    char tmp[264];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", o->file);
+    if(o->err == 1 || rename(tmp, o->file) < 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int snapAppend(const char* file, const snapheader* h, const sim* s, const uint64_t step, const philox* rng)
+{
+    snapheader nh;
+    const int fd = open(file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    if(fd < 0){return -1;}
+    const ssize_t got = read(fd, &nh, sizeof(snapheader));
+    if(got == 0)
+    {
+        nh = *h;
+        nh.count = 0;
+        snapFill(&nh);
+    }
+    else if(got != sizeof(snapheader) || nh.magic != SNAP_MAGIC || nh.version != SNAP_VERSION ||
+        nh.header_sum != snapHeaderSum(&nh) || nh.spheres != s->n){close(fd); return -1;}
+
+    int r = -1;
+    char* rec = malloc(nh.record_bytes);
+    if(rec != NULL)
+    {
+        snapPack(rec, s, step, rng);
+        const off_t at = nh.header_bytes + (off_t)nh.count*nh.record_bytes;
+        if(pwrite(fd, rec, nh.record_bytes, at) == (ssize_t)nh.record_bytes)
+        {
+            nh.count++;
+            nh.header_sum = snapHeaderSum(&nh);
+            if(pwrite(fd, &nh, sizeof(snapheader), 0) == sizeof(snapheader)){r = 0;}
+        }
+        free(rec);
+    }
+    close(fd);
+    return r;
+}
+
+int snapOpen(snapfile* f, const char* file)
+{
+    memset(f, 0, sizeof(snapfile));
+    const int fd = open(file, O_RDONLY);
+    if(fd < 0){return -1;}
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(snapheader)){close(fd); return -1;}
+    f->bytes = st.st_size;
+    void* p = mmap(NULL, f->bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED){return -1;}
+    f->map = p;
+
+    memcpy(&f->h, f->map, sizeof(snapheader));
+    const snapheader* h = &f->h;
+    if(h->magic != SNAP_MAGIC || h->version != SNAP_VERSION || h->header_sum != snapHeaderSum(h) || h->count == 0 ||
+        h->record_bytes != sizeof(snaprec) + h->spheres*6*sizeof(float) ||
+        h->header_bytes + h->count*h->record_bytes > f->bytes){snapClose(f); return -1;}
+    return 0;
+}
+
+void snapClose(snapfile* f)
+{
+    if(f->map != NULL){munmap((void*)f->map, f->bytes);}
+    f->map = NULL;
+}
+
+const snaprec* snapRecord(const snapfile* f, const uint64_t i)
+{
+    return (const snaprec*)(f->map + f->h.header_bytes + i*f->h.record_bytes);
+}
+
+const float* snapState(const snapfile* f, const uint64_t i)
+{
+    return (const float*)((const char*)snapRecord(f, i) + sizeof(snaprec));
+}
+
+int snapGet(const snapfile* f, const uint64_t i, sim* s, uint64_t* step, philox* rng)
+{
+    if(i >= f->h.count || s->n != f->h.spheres){return -1;}
+    const snaprec* k = snapRecord(f, i);
+    const float* state = snapState(f, i);
+    float* a[6] = {s->x, s->y, s->z, s->dx, s->dy, s->dz};
+    for(int c = 0; c < 6; c++)
+        for(unsigned int j = 0; j < s->n; j++)
+            a[c][simSlot(s, j)] = state[c*s->n + j];
+    s->verlet.stale = 1;
+    if(step != NULL){*step = k->step;}
+    if(rng != NULL)
+    {
+        pxSeed(rng, k->key, k->stream);
+        rng->block = k->block;
+        memcpy(rng->buf, k->buf, sizeof(rng->buf));
+        rng->left = k->left;
+    }
+    return 0;
+}
+
+#endif
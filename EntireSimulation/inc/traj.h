@@ -0,0 +1,96 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Reader for the trajectory datasets written by ucc -f t.
+
+    A trajectory shard is a sequence of frames, each frame is the
+    state of every universe of one worker (k universes of n spheres
+    of x,y,z,dx,dy,dz floats, the same layout as an X row) and the
+    frame after holds the next state of each universe. So sample
+    idx of universe idx % k at frame idx / k has its X row in that
+    frame and the Y row for horizon h is the positions in frame
+    t + h, any number of horizons can be read from the one file.
+
+    The file is mapped rather than read so only the frames that are
+    touched are paged in, n and k come from its dsheader.
+
+    Requires dsfile.h
+*/
+
+#ifndef TRAJ_H
+#define TRAJ_H
+
+#include "dsfile.h"
+
+typedef struct
+{
+    dsfile d;
+    const float* f;      // first frame
+    unsigned int n;      // spheres per universe
+    unsigned int k;      // universes per frame
+    uint64_t frames;
+} trajfile;
+
+int  trajOpen(trajfile* t, const char* file); // -1 if it is not a trajectory
+void trajClose(trajfile* t);
+
+// samples that have every horizon up to max_horizon
+uint64_t trajSamples(const trajfile* t, const unsigned int max_horizon);
+
+// the state of universe u at frame f, n*6 floats
+const float* trajState(const trajfile* t, const uint64_t f, const unsigned int u);
+
+// x gets the n*6 floats of the state, y gets n*3 positions per horizon in the order given
+void trajSample(const trajfile* t, const uint64_t idx, const unsigned int* horizons, const unsigned int nh, float* x, float* y);
+
+//
+
+int trajOpen(trajfile* t, const char* file)
+{
+    memset(t, 0, sizeof(trajfile));
+    if(dsOpen(&t->d, file) < 0){return -1;}
+    const dsheader* h = &t->d.h;
+    if(h->content != DS_TRAJECTORY || h->universes == 0){dsClose(&t->d); return -1;}
+    t->f = t->d.rows;
+    t->n = h->spheres;
+    t->k = h->universes;
+    t->frames = h->rows / h->universes;
+    return 0;
+}
+
+void trajClose(trajfile* t)
+{
+    dsClose(&t->d);
+    t->f = NULL;
+}
+
+uint64_t trajSamples(const trajfile* t, const unsigned int max_horizon)
+{
+    if(t->frames <= max_horizon){return 0;}
+    return (t->frames - max_horizon) * t->k;
+}
+
+const float* trajState(const trajfile* t, const uint64_t f, const unsigned int u)
+{
+    return t->f + (f * t->k + u) * t->n * 6;
+}
+
+void trajSample(const trajfile* t, const uint64_t idx, const unsigned int* horizons, const unsigned int nh, float* x, float* y)
+{
+    const uint64_t f = idx / t->k;
+    const unsigned int u = idx % t->k;
+    memcpy(x, trajState(t, f, u), t->n * 6 * sizeof(float));
+    for(unsigned int h = 0; h < nh; h++)
+    {
+        const float* s = trajState(t, f + horizons[h], u);
+        for(unsigned int i = 0; i < t->n; i++)
+        {
+            *y++ = s[i*6];
+            *y++ = s[i*6+1];
+            *y++ = s[i*6+2];
+        }
+    }
+}
+
+#endif
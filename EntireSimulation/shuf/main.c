@@ -0,0 +1,422 @@
+/*
+    James William Fletcher (github.com/mrbid)
+        May 2022
+
+    Info:
+
+        Out-of-core shuffle of a dataset into numpy_x.npy and numpy_y.npy.
+
+        shuff.py loads the whole dataset and shuffles X and Y in unison
+        in memory, which needs every sample in RAM twice over. ushuf does
+        the same job in two sequential passes within a memory budget (-m):
+
+        1. The shards are read in large blocks, the X and Y rows of a
+           sample together, and each sample is appended to one of B
+           temporary bucket files (ushuf.NNNN.tmp) picked at random. B
+           is the smallest count that lets a bucket fit in half of the
+           budget. NaNs are zeroed and infinities clamped to the largest
+           float on the way through, as np.nan_to_num() did.
+        2. Each bucket in turn is read whole, its samples are put in a
+           random order (Fisher-Yates) and their X and Y rows appended
+           to the two .npy files, then the bucket is deleted.
+
+        Sending every sample to a uniformly random bucket and then
+        uniformly permuting each bucket gives a uniformly random
+        permutation of the whole dataset (Rao-Sandelius) and X and Y
+        never separate. The random numbers come from Philox
+        (inc/philox.h) so -d seed repeats a shuffle of the same data
+        with the same -m, which sets the bucket count.
+
+        The samples are those of the shards in dataset.manifest, X and
+        the first label set, or with -n spheres those of the raw
+        dataset_x.dat and dataset_y.dat. A trajectory or a sparse label
+        set is expanded to the raw files with python3 dataset.py cat
+        first. Writes go through the
+        background writer of inc/awrite.h so they overlap the reads.
+
+        The .npy files are what shuff.py saved and train.py loads them
+        the same way, peak disk use is the dataset, the buckets and the
+        part of the output made so far as each bucket is deleted once
+        it is written.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <float.h>
+
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../inc/dsfile.h"
+#include "../inc/awrite.h"
+#include "../inc/philox.h"
+
+#define f32 float
+
+//*************************************
+// globals
+//*************************************
+uint64_t MEMORY = 1024; // MB budget
+uint NUM_SPHERES = 0;   // of the raw files, 0 reads dataset.manifest
+const char* TEMP = "."; // where the buckets go
+
+#define MAX_BUCKETS 1000
+
+typedef struct
+{
+    char x[64], y[64];
+    off_t xo, yo;       // byte offset of the first row
+    uint64_t rows;
+} source;
+
+source* sources;
+uint num_sources = 0;
+uint XF = 0, YF = 0;    // floats of an X and a Y row
+awriter writer;
+
+//*************************************
+// utility functions
+//*************************************
+uint64_t urand()
+{
+    int f = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    uint64_t s = 0;
+    if(read(f, &s, sizeof(uint64_t)) != sizeof(uint64_t)){s = time(0);}
+    close(f);
+    return s;
+}
+
+double seconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+// the whole of bytes at offset, -1 on a short read
+int readAt(const int fd, void* buf, const size_t bytes, const off_t offset)
+{
+    size_t got = 0;
+    while(got < bytes)
+    {
+        const ssize_t r = pread(fd, (char*)buf + got, bytes - got, offset + got);
+        if(r <= 0){return -1;}
+        got += r;
+    }
+    return 0;
+}
+
+// np.nan_to_num() in place, counts the NaNs
+uint64_t scrub(f32* r, const uint n)
+{
+    uint64_t nans = 0;
+    for(uint i = 0; i < n; i++)
+    {
+        uint32_t u;
+        memcpy(&u, &r[i], 4);
+        if((u & 0x7f800000) != 0x7f800000){continue;}
+        if((u & 0x007fffff) != 0){r[i] = 0.f; nans++;}
+        else{r[i] = (u >> 31) ? -FLT_MAX : FLT_MAX;}
+    }
+    return nans;
+}
+
+//*************************************
+// sources
+//*************************************
+// the rows of a shard from its header, -1 if it is not a dense dataset file of the same row size as the others
+int addShard(source* s, const char* file, const uint y)
+{
+    dsfile f;
+    if(dsOpen(&f, file) < 0){return -1;}
+    const dsheader h = f.h;
+    dsClose(&f);
+    if(h.content == DS_TRAJECTORY || h.content == DS_Y_SPARSE || (y == 0) != (h.content == DS_X)){return -1;}
+    uint* floats = y == 1 ? &YF : &XF;
+    if(*floats != 0 && *floats != h.row_floats){return -1;}
+    *floats = h.row_floats;
+    snprintf(y == 1 ? s->y : s->x, 64, "%s", file);
+    if(y == 1){s->yo = h.header_bytes;}
+    else{s->xo = h.header_bytes;}
+    if(y == 0 || h.rows < s->rows){s->rows = h.rows;} // an unfinished pair is cut to the rows they both have
+    return 0;
+}
+
+// X and the first label set of every shard of a pairs dataset
+int readManifest(const char* file)
+{
+    FILE* f = fopen(file, "r");
+    if(f == NULL){return -1;}
+    char line[1024];
+    int r = 0;
+    uint cap = 0;
+    while(r == 0 && fgets(line, sizeof(line), f) != NULL)
+    {
+        char a[64], b[64];
+        if(sscanf(line, "format %63s", a) == 1 && strcmp(a, "pairs") != 0)
+        {
+            printf("A %s dataset, python3 dataset.py cat then ushuf -n spheres shuffles it.\n", a);
+            r = -1;
+        }
+        if(strncmp(line, "shard ", 6) != 0 || sscanf(line + 6, "%63s %63s", a, b) != 2){continue;}
+        if(num_sources == cap)
+        {
+            cap = cap == 0 ? 64 : cap*2;
+            source* n = realloc(sources, cap*sizeof(source));
+            if(n == NULL){r = -1; break;}
+            sources = n;
+        }
+        source* s = &sources[num_sources++];
+        memset(s, 0, sizeof(source));
+        if(addShard(s, a, 0) < 0 || addShard(s, b, 1) < 0)
+        {
+            printf("%s and %s are not a pair of dense shards like the others, a sparse label set needs python3 dataset.py cat then ushuf -n spheres.\n", a, b);
+            r = -1;
+        }
+    }
+    fclose(f);
+    return r;
+}
+
+// the headerless dataset_x.dat and dataset_y.dat, sized by the sphere count
+int readRaw()
+{
+    struct stat sx, sy;
+    if(stat("dataset_x.dat", &sx) < 0 || stat("dataset_y.dat", &sy) < 0){return -1;}
+    sources = calloc(1, sizeof(source));
+    if(sources == NULL){return -1;}
+    XF = NUM_SPHERES*6;
+    YF = NUM_SPHERES*3;
+    source* s = &sources[num_sources++];
+    sprintf(s->x, "dataset_x.dat");
+    sprintf(s->y, "dataset_y.dat");
+    const uint64_t rx = sx.st_size / (XF*sizeof(f32)), ry = sy.st_size / (YF*sizeof(f32));
+    s->rows = rx < ry ? rx : ry;
+    return 0;
+}
+
+//*************************************
+// output
+//*************************************
+// a .npy version 1.0 header for a rows by cols float32 array, padded so the data starts 64 byte aligned
+int npyCreate(astream* s, const char* file, const uint64_t rows, const uint cols, const size_t cap)
+{
+    char h[128];
+    memset(h, ' ', sizeof(h));
+    const int n = sprintf(h + 10, "{'descr': '<f4', 'fortran_order': False, 'shape': (%lu, %u), }", rows, cols);
+    h[10 + n] = ' ';
+    const uint total = (10 + n + 1 + 63) & ~63;
+    memcpy(h, "\x93NUMPY\x01\x00", 8);
+    h[8] = (total - 10) & 0xff;
+    h[9] = (total - 10) >> 8;
+    h[total - 1] = '\n';
+
+    const int fd = open(file, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+    if(fd < 0){return -1;}
+    const ssize_t w = write(fd, h, total);
+    close(fd);
+    if(w != total){return -1;}
+    return asOpen(s, &writer, file, cap);
+}
+
+void bucketName(char* r, const uint b)
+{
+    sprintf(r, "%s/ushuf.%04u.tmp", TEMP, b);
+}
+
+//*************************************
+// Process Entry Point
+//*************************************
+int main(int argc, char** argv)
+{
+    uint64_t seed = 0;
+    uint seeded = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "m:d:n:T:")) != -1)
+    {
+        if(opt == 'm'){MEMORY = strtoull(optarg, NULL, 10);}
+        else if(opt == 'd'){seed = strtoull(optarg, NULL, 10); seeded = 1;}
+        else if(opt == 'n'){NUM_SPHERES = atoi(optarg); if(NUM_SPHERES < 1){NUM_SPHERES = 1;}}
+        else if(opt == 'T'){TEMP = optarg;}
+        else
+        {
+            printf("Usage: %s [-m MB] [-d seed] [-n spheres] [-T dir]\n", argv[0]);
+            printf("  -m MB         memory budget (default 1024)\n");
+            printf("  -d seed       repeat a shuffle, the same data, seed and -m give the same order\n");
+            printf("  -n spheres    shuffle the raw dataset_x.dat and dataset_y.dat of this many spheres instead of dataset.manifest\n");
+            printf("  -T dir        directory for the temporary buckets (default .)\n");
+            return 1;
+        }
+    }
+    if(MEMORY < 16)
+    {
+        printf("Need at least 16 MB.\n");
+        return 1;
+    }
+    if(seeded == 0){seed = urand();}
+    const double st = seconds();
+
+    // the samples to shuffle
+    if(NUM_SPHERES == 0 ? readManifest("dataset.manifest") < 0 : readRaw() < 0)
+    {
+        printf(NUM_SPHERES == 0 ? "Nothing to shuffle, need a pairs dataset.manifest.\n" : "Nothing to shuffle, need dataset_x.dat and dataset_y.dat.\n");
+        return 1;
+    }
+    uint64_t total = 0;
+    for(uint i = 0; i < num_sources; i++){total += sources[i].rows;}
+    const size_t xb = XF*sizeof(f32), yb = YF*sizeof(f32), rb = xb + yb;
+    const uint64_t budget = MEMORY*1048576;
+    const uint64_t buckets = (total*rb + budget/2 - 1) / (budget/2);
+    if(total == 0 || buckets > MAX_BUCKETS)
+    {
+        if(total == 0){printf("The dataset has no samples.\n");}
+        else{printf("%lu MB is too little for %lu samples, a bucket has to fit in half of it.\n", MEMORY, total);}
+        return 1;
+    }
+    const uint nb = buckets > 0 ? buckets : 1;
+    printf("Seed %lu, ushuf -m %lu -d %lu repeats this shuffle.\n", seed, MEMORY, seed);
+    printf("Dataset Size: %lu samples of %u and %u floats in %u buckets\n", total, XF, YF, nb);
+
+    // a quarter of the budget reads and a quarter buffers the buckets, two buffers each
+    if(awInit(&writer) < 0){return 1;}
+    astream* bucket = malloc(nb*sizeof(astream));
+    uint64_t* count = calloc(nb, sizeof(uint64_t));
+    size_t block = budget/4 / rb;
+    size_t cap = budget/4 / (2*nb) / rb * rb;
+    if(block < 1){block = 1;}
+    if(cap < rb){cap = rb;}
+    f32* bx = malloc(block*xb);
+    f32* by = malloc(block*yb);
+    if(bucket == NULL || count == NULL || bx == NULL || by == NULL){return 1;}
+    for(uint b = 0; b < nb; b++)
+    {
+        char name[512];
+        bucketName(name, b);
+        unlink(name);
+        if(asOpen(&bucket[b], &writer, name, cap) < 0)
+        {
+            printf("Can not create %s.\n", name);
+            return 1;
+        }
+    }
+
+    // 1. scatter every sample to a random bucket
+    philox p;
+    pxSeed(&p, seed, 0);
+    uint64_t nan_x = 0, nan_y = 0;
+    for(uint i = 0; i < num_sources; i++)
+    {
+        const source* s = &sources[i];
+        const int fx = open(s->x, O_RDONLY), fy = open(s->y, O_RDONLY);
+        if(fx < 0 || fy < 0)
+        {
+            printf("Can not read %s and %s.\n", s->x, s->y);
+            return 1;
+        }
+        for(uint64_t r = 0; r < s->rows; r += block)
+        {
+            const size_t n = s->rows - r < block ? s->rows - r : block;
+            if(readAt(fx, bx, n*xb, s->xo + r*xb) < 0 || readAt(fy, by, n*yb, s->yo + r*yb) < 0)
+            {
+                printf("Failed reading %s and %s.\n", s->x, s->y);
+                return 1;
+            }
+            for(size_t k = 0; k < n; k++)
+            {
+                const uint b = pxBelow(&p, nb);
+                astream* o = &bucket[b];
+                if(asFree(o) < rb && asSwap(o) < 0)
+                {
+                    printf("Failed writing bucket %u.\n", b);
+                    return 1;
+                }
+                f32* w = (f32*)asPtr(o);
+                memcpy(w, &bx[k*XF], xb);
+                memcpy(w + XF, &by[k*YF], yb);
+                nan_x += scrub(w, XF);
+                nan_y += scrub(w + XF, YF);
+                asCommit(o, rb);
+                count[b]++;
+            }
+        }
+        close(fx);
+        close(fy);
+    }
+    uint64_t largest = 0;
+    for(uint b = 0; b < nb; b++)
+    {
+        if(asClose(&bucket[b]) < 0)
+        {
+            printf("Failed writing bucket %u.\n", b);
+            return 1;
+        }
+        if(count[b] > largest){largest = count[b];}
+    }
+    free(bx);
+    free(by);
+    printf("NaN's detected: %lu in X and %lu in Y, zeroed\n", nan_x, nan_y);
+
+    // 2. permute each bucket in memory and append it to the outputs, their four buffers share a quarter of the budget
+    astream ox, oy;
+    char* buf = malloc(largest*rb);
+    uint32_t* order = malloc(largest*sizeof(uint32_t));
+    if(buf == NULL || order == NULL)
+    {
+        printf("Out of memory for a bucket of %lu samples.\n", largest);
+        return 1;
+    }
+    if(npyCreate(&ox, "numpy_x.npy", total, XF, budget/16) < 0 || npyCreate(&oy, "numpy_y.npy", total, YF, budget/16) < 0)
+    {
+        printf("Can not create numpy_x.npy and numpy_y.npy.\n");
+        return 1;
+    }
+    for(uint b = 0; b < nb; b++)
+    {
+        char name[512];
+        bucketName(name, b);
+        const int fd = open(name, O_RDONLY);
+        if(fd < 0 || readAt(fd, buf, count[b]*rb, 0) < 0)
+        {
+            printf("Failed reading bucket %u.\n", b);
+            return 1;
+        }
+        close(fd);
+        unlink(name);
+
+        for(uint32_t i = 0; i < count[b]; i++){order[i] = i;}
+        for(uint32_t i = count[b]; i > 1; i--)
+        {
+            const uint32_t j = pxBelow(&p, i);
+            const uint32_t t = order[i-1];
+            order[i-1] = order[j];
+            order[j] = t;
+        }
+        for(uint64_t i = 0; i < count[b]; i++)
+        {
+            const char* r = buf + order[i]*rb;
+            if((asFree(&ox) < xb && asSwap(&ox) < 0) || (asFree(&oy) < yb && asSwap(&oy) < 0))
+            {
+                printf("Failed writing numpy_x.npy and numpy_y.npy.\n");
+                return 1;
+            }
+            memcpy(asPtr(&ox), r, xb);
+            asCommit(&ox, xb);
+            memcpy(asPtr(&oy), r + xb, yb);
+            asCommit(&oy, yb);
+        }
+    }
+    if(asClose(&ox) < 0 || asClose(&oy) < 0)
+    {
+        printf("Failed writing numpy_x.npy and numpy_y.npy.\n");
+        return 1;
+    }
+    awClose(&writer);
+
+    printf("Time Taken: %.2f seconds, largest bucket %lu MB\n", seconds() - st, largest*rb/1048576);
+
+    // done
+    return 0;
+}
@@ -6,15 +6,15 @@ import numpy as np
 from time import time_ns
 from os import mkdir
 from os.path import isdir
+import dataset
 
 # print everything / no truncations
 np.set_printoptions(threshold=sys.maxsize)
 
 # training set size
-inputsize = 96
-outputsize = 48
-tss = int(os.stat("dataset_y.dat").st_size / 192)
-print("Dataset Size:", "{:,}".format(tss))
+spheres = int(os.environ.get('SPHERES', 16)) # must match the generator (ucc -n)
+inputsize = spheres*6
+outputsize = spheres*3
 
 # helpers (https://stackoverflow.com/questions/4601373/better-way-to-shuffle-two-numpy-arrays-in-unison)
 def shuffle_in_unison(a, b):
@@ -33,18 +33,14 @@ train_x = []
 train_y = []
 
 print("Loading & Reshaping...")
-with open("dataset_x.dat", 'rb') as f:
-    data = np.fromfile(f, dtype=np.float32)
-    train_x = np.reshape(data, [tss, inputsize])
-
-with open("dataset_y.dat", 'rb') as f:
-    data = np.fromfile(f, dtype=np.float32)
-    train_y = np.reshape(data, [tss, outputsize])
+train_x, train_y = dataset.read(inputsize, outputsize)
+tss = train_x.shape[0]
+print("Dataset Size:", "{:,}".format(tss))
 
 print("Shuffling...")
 shuffle_in_unison(train_x, train_y)
 
-print("NaN's detected:", np.count_nonzero(np.isnan(data)))
+print("NaN's detected:", np.count_nonzero(np.isnan(train_y)))
 
 print("Saving & Zeroing NaN's...")
 np.save("numpy_x.npy", np.nan_to_num(train_x))
@@ -22,6 +22,7 @@ from sys import exit
 from os.path import isfile
 from os import mkdir
 from os.path import isdir
+import dataset
 
 # import tensorflow as tf
 # from tensorflow.python.client import device_lib
@@ -42,8 +43,9 @@ seed(74035)
 model_name = 'keras_model'
 shuffled = ''
 optimiser = 'adam'
-inputsize = 96
-outputsize = 48
+spheres = int(os.environ.get('SPHERES', 16)) # must match the generator (ucc -n)
+inputsize = spheres*6
+outputsize = spheres*3
 training_iterations = 1
 activator = 'tanh'
 layers = 8
@@ -78,10 +80,6 @@ if argc >= 8 and sys.argv[7] == '1':
 # make sure save dir exists
 if not isdir('models'): mkdir('models')
 
-# training set size
-tss = int(os.stat("dataset_y.dat").st_size / 192)
-print("Dataset Size:", "{:,}".format(tss))
-
 ##########################################
 #   LOAD DATA
 ##########################################
@@ -98,13 +96,9 @@ if isfile("numpy_x.npy") and not mode == "1D":
     model_name = 'models/' + activator + '_' + optimiser + '_' + sys.argv[1] + '_' + sys.argv[2] + '_' + sys.argv[3] + '_' + mode + '_shuf'
     print("model_name:", model_name)
 else:
-    with open("dataset_x.dat", 'rb') as f:
-        data = np.fromfile(f, dtype=np.float32)
-        train_x = np.reshape(data, [tss, inputsize])
-
-    with open("dataset_y.dat", 'rb') as f:
-        data = np.fromfile(f, dtype=np.float32)
-        train_y = np.reshape(data, [tss, outputsize])
+    train_x, train_y = dataset.read(inputsize, outputsize)
+    tss = train_x.shape[0]
+    print("Dataset Size:", "{:,}".format(tss))
 
     print("Loaded regular arrays; no shuffle")
     model_name = 'models/' + activator + '_' + optimiser + '_' + sys.argv[1] + '_' + sys.argv[2] + '_' + sys.argv[3] + '_' + mode